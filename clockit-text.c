@@ -10,13 +10,24 @@
 
   The other modification is to dim the display at 7PM and brighten the display at 7AM.
 
+  The clock also keeps the date so the alarm can be limited to certain days of the week.
+  To set the date, press and hold UP then press and hold SNOOZE for two seconds. UP/DOWN
+  change the year, month, day and then the alarm days (1-7 every day, 1-5 weekdays,
+  6-7 weekends, SEL to pick them). SNOOZE moves on to the next field. After SEL each
+  day shows as 1 to 7 (Monday is 1) with on or of, and UP/DOWN turn it on or off.
+
+  Press UP on its own for the stopwatch. SNOOZE starts and stops it, DOWN clears it.
+  Press UP again for the countdown timer. DOWN adds a minute to the countdown, SNOOZE
+  starts and stops it and silences it once it has run out. UP goes back to the clock.
+
   Alarm is through a piezo buzzer.
   Three input buttons (up/down/snooze)
   1 slide switch (engage/disengage alarm)
 
   Display is with PWM of segments - no current limiting resistors!
 
-  Uses external 16MHz clock as time base.
+  Uses external 16MHz clock as time base. The timers are set up from F_CPU, so it also
+  builds for an 8MHz clock (make F_CPU=8000000) and for the ATmega328P.
 
   Set fuses:
   avrdude -p m168 -P lpt1 -c stk200 -U lfuse:w:0xE6:m
@@ -31,17 +42,73 @@
 */
 
 #define NORMAL_TIME
+//#define LIGHT_SENSOR //Set the brightness from the room light (make LIGHT_SENSOR=1), without it DIM_BEFORE_HOUR and BRIGHT_AFTER_HOUR do
 
 #include <stdio.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <util/atomic.h>
 #include <string.h>
+#include <stddef.h>
+
+#include "clockit-text.h"
 
 #define sbi(port, pin)   ((port) |= (uint8_t)(1 << pin))
 #define cbi(port, pin)   ((port) &= (uint8_t)~(1 << pin))
 
-#define FOSC 16000000 //16MHz internal osc
+//Timer settings are worked out from F_CPU, which the Makefile sets. Each timer needs a
+//whole number of clicks for its period or the clock drifts, so other speeds fail here.
+#ifndef F_CPU
+#error "F_CPU is not set, see the Makefile"
+#endif
+
+//Timer 1 counts seconds, with the slowest prescaler that divides F_CPU exactly
+#if F_CPU % 1024 == 0 && F_CPU / 1024 <= 65536
+#define TIMER1_PRESCALER 1024
+#define TIMER1_CS ((1<<CS12)|(1<<CS10))
+#elif F_CPU % 256 == 0 && F_CPU / 256 <= 65536
+#define TIMER1_PRESCALER 256
+#define TIMER1_CS (1<<CS12)
+#else
+#error "Timer 1 can't count whole seconds at this F_CPU"
+#endif
+#define TIMER1_CLICKS_PER_SECOND (F_CPU / TIMER1_PRESCALER) //15625 at 16MHz, 31250 at 8MHz
+
+//ms = clicks * MILLIS_SCALE >> 16, rounded down so it stays under 1000 and at most
+//1 short of clicks * 1000 / TIMER1_CLICKS_PER_SECOND without dividing
+#define MILLIS_SCALE (65536UL * 1000 / TIMER1_CLICKS_PER_SECOND) //4194 at 16MHz
+#if MILLIS_SCALE > 65535
+#error "Timer 1 counts too few clicks a second for millis()"
+#endif
+
+//Timer 2 times the display slots and needs whole clicks per us for the brightness
+#define TIMER2_PRESCALER 8
+#if F_CPU % (TIMER2_PRESCALER * 1000000) != 0
+#error "Timer 2 needs whole clicks per us, F_CPU must be a multiple of 8MHz"
+#endif
+#define TIMER2_CS (1<<CS21)
+#define TIMER2_SLOW_CS ((1<<CS21)|(1<<CS20)) //clk/32, SUPPLY_SLOW times slower for a weak supply
+
+//Timer 0 sounds the piezo and, with TELEMETRY, times the serial bits. It counts round
+//freely and each compare match moves its own register on. The tone doesn't have to be
+//exact, just within 2%, and a serial line is fine within 2% as well.
+#define TIMER0_PRESCALER 64
+#define TONE_US 300 //Between flips of the piezo
+#define TONE_CLICKS ((F_CPU / TIMER0_PRESCALER * TONE_US + 500000) / 1000000)
+#if TONE_CLICKS > 255 || TONE_CLICKS * 1000000 * 50 > F_CPU / TIMER0_PRESCALER * TONE_US * 51 || \
+    TONE_CLICKS * 1000000 * 50 < F_CPU / TIMER0_PRESCALER * TONE_US * 49
+#error "Timer 0 can't make the tone at this F_CPU"
+#endif
+#define TELEMETRY_BAUD 9600
+#define TELEMETRY_BIT_CLICKS ((F_CPU / TIMER0_PRESCALER + TELEMETRY_BAUD / 2) / TELEMETRY_BAUD) //26 at 16MHz
+#if TELEMETRY_BIT_CLICKS * TELEMETRY_BAUD * 50 > F_CPU / TIMER0_PRESCALER * 51 || \
+    TELEMETRY_BIT_CLICKS * TELEMETRY_BAUD * 50 < F_CPU / TIMER0_PRESCALER * 49
+#error "Timer 0 can't time TELEMETRY_BAUD at this F_CPU"
+#endif
 
 #define STATUS_LED  5 //PORTB
 
@@ -71,6 +138,26 @@
 #define BUZZ1  PORTB1
 #define BUZZ2  PORTB2
 
+//Buttons as read by check_buttons()
+#define PRESS_UP      (1<<BUT_UP)
+#define PRESS_DOWN    (1<<BUT_DOWN)
+#define PRESS_SNOOZE  (1<<BUT_SNOOZE)
+
+#define ALL_DIGITS  ((1<<DIG_1)|(1<<DIG_2)|(1<<DIG_3)|(1<<DIG_4)|(1<<COL)) //Digit pins are low to light
+#define SEGMENT_D   0b10000000 //Segment D and the decimal point are on PORTD, see post_slot()
+#define SEGMENT_DP  0b01000000
+
+#define FRAME_SLOTS 12 //Display slots per frame, 12 * 128us is about 650Hz
+#define SLOT_US 128
+#if SLOT_US * (F_CPU / TIMER2_PRESCALER / 1000000) > 256
+#error "A display slot is more than 256 Timer 2 clicks at this F_CPU"
+#endif
+#define CLICKS_PER_US ((uint8_t)(F_CPU / TIMER2_PRESCALER / 1000000)) //Timer 2 clicks, 2 at 16MHz
+#define SLOT_CLICKS (SLOT_US * CLICKS_PER_US) //Timer 2 clicks per slot
+#define MAX_ON_CLICKS (SLOT_CLICKS - 8 * CLICKS_PER_US) //Leave time for the next slot to start
+#define FRAME_CLICKS (FRAME_SLOTS * SLOT_CLICKS)
+#define CLICKS_PER_MS (1000 * CLICKS_PER_US)
+
 #define AM  1
 #define PM  2
 
@@ -78,43 +165,314 @@
 #define DIM 1
 #define DIM_BEFORE_HOUR 7
 #define BRIGHT_AFTER_HOUR 7
+//LIGHT_SENSOR only. Both are guesses until measured against a real display and room.
+#define LIGHT_SCALE 50000 //us x us, the on time in us is LIGHT_SCALE / the LED discharge time in us
+#define LIGHT_MAX_ON 100 //On time in us for a bright room, at most MAX_ON_CLICKS
+
+//Supply voltage, see check_supply(). 16MHz is only rated down to 4.5V, 8MHz to 2.7V.
+#define SUPPLY_BANDGAP_MV 1100 //Internal reference, 1.0 to 1.2V from chip to chip
+#if F_CPU > 10000000
+#define SUPPLY_LOW_MV 4300 //Below this the on time is held to SUPPLY_LOW_ON
+#define SUPPLY_WEAK_MV 4000 //Below this the display refreshes SUPPLY_SLOW times slower as well
+#else
+#define SUPPLY_LOW_MV 3300
+#define SUPPLY_WEAK_MV 3000
+#endif
+#define SUPPLY_HYSTERESIS_MV 100 //Needed above a threshold to go back
+#define SUPPLY_LOW_ON 10 //us
+#define SUPPLY_SLOW 4 //TIMER2_SLOW_CS against TIMER2_CS
+
+//Scheduler timings in ms
+#define RENDER_PERIOD 10
+#define BUTTON_PERIOD 10
+#define ALARM_PERIOD 50
+#define ALARM_SWITCH_READS 2 //ALARM_PERIODs the alarm switch must stay moved for
+#define SCROLL_PERIOD 180
+#define DATE_REPEAT_PERIOD 250
+#define BLINK_PERIOD 250
+#define HOLD_TIME 2000 //Hold buttons this long to change a setting
+#define SIREN_ON_TIME 300
+#define SIREN_GAP_TIME 50
+#define STACK_PERIOD 1000
+#define ENERGY_PERIOD 1000
+#define ENERGY_SAVE_COUNT 3600 //ENERGY_PERIODs between saves to the EEPROM, an hour
+#define LIGHT_PERIOD 4000
+#define LIGHT_MAX_MS 16 //Longest the display goes dark for a light reading, slower is a dark room
+#define SUPPLY_PERIOD 250
+#define TELEMETRY_PERIOD 1000 //The refresh rate sent is the frames shown in this time
+
+#define WHEEL_SLOTS 16 //Timer wheel slots, must be a power of 2
+#define TASK_BIT(task) ((uint16_t)1<<(task))
+
+#define BLINK_FOREVER 255
+
+#define STACK_PAINT 0xC5 //Fills the free RAM at boot so check_stack() can see how deep the stack has been
+
+#define SAVED_SEED 0x5A //Starts the saved time checksum, so zeroed RAM doesn't pass
+#define RESTART_MS 80 //From saving the time to running again after a watchdog reset: 15ms
+                     //of watchdog and the 65ms start-up delay (SUT = 10)
+
+//TRACE events are in clockit-text.h
+#define TRACE_PIN    PORTB3 //High while a traced interrupt runs, not used by the clock
+
+//Build with TELEMETRY (make TELEMETRY=1) to send a struct telemetry out of PB3 every
+//TELEMETRY_PERIOD, at TELEMETRY_BAUD 8N1. The same hooks in the interrupts then time them
+//instead, in Timer 2 clicks, for the longest each has taken. PB3 can't do both.
+#define TELEMETRY_PIN    PORTB3
+#define TELEMETRY_SYNC   0xA5 //First byte of each record
+#define TELEMETRY_PM     0x80 //In telemetry.hours
+#define TELEMETRY_ALARM_ON     0x01 //telemetry.state bits
+#define TELEMETRY_SNOOZE       0x02
+#define TELEMETRY_ALARM_GOING  0x04
+#define TELEMETRY_SUPPLY       3 //supply_state from this bit up
+
+#if defined(TRACE) && defined(TELEMETRY)
+#error "TRACE and TELEMETRY both use PB3, build with one or the other"
+#endif
+
+#ifdef TRACE
+#define trace_isr_start(source) if((TRACE) & (1<<(source))) { sbi(PORTB, TRACE_PIN); trace_event(source); }
+#define trace_isr_end(source) if((TRACE) & (1<<(source))) { trace_event((source) | TRACE_END); cbi(PORTB, TRACE_PIN); }
+#define TRACE_TASKS ((uint16_t)((TRACE) >> TRACE_TASK)) //TASK_BITs of the traced tasks
+#define trace_task_start(task) if(TRACE_TASKS & TASK_BIT(task)) ATOMIC_BLOCK(ATOMIC_RESTORESTATE) trace_event(TRACE_TASK + (task))
+#define trace_task_end(task) if(TRACE_TASKS & TASK_BIT(task)) ATOMIC_BLOCK(ATOMIC_RESTORESTATE) trace_event((TRACE_TASK + (task)) | TRACE_END)
+#elif defined(TELEMETRY)
+#define trace_isr_start(source) uint8_t isr_from = TCNT2
+#define trace_isr_end(source) isr_took(source, isr_from)
+#define trace_task_start(task)
+#define trace_task_end(task)
+#else
+#define trace_isr_start(source)
+#define trace_isr_end(source)
+#define trace_task_start(task)
+#define trace_task_end(task)
+#endif
+
+#define SUNDAY    0
+#define MONDAY    1
+#define TUESDAY   2
+#define WEDNESDAY 3
+#define THURSDAY  4
+#define FRIDAY    5
+#define SATURDAY  6
 
-enum { SHOW_TIME, SET_TIME, SHOW_ALARM, SET_ALARM } program_state = SHOW_TIME;
+//Alarm day masks, bit n is set if the alarm may go off on weekday n
+#define ALARM_EVERY_DAY 0b01111111
+#define ALARM_WEEKDAYS  0b00111110
+#define ALARM_WEEKENDS  0b01000001
+#define ALARM_DAY_PRESETS 3 //In ALARM_DAY_MASKS, the next choice picks the days one at a time
+
+enum { SHOW_TIME, SET_TIME, SHOW_ALARM, SET_ALARM, SET_DATE, STOPWATCH, COUNTDOWN }; //program_state
+enum { SUPPLY_GOOD, SUPPLY_LOW, SUPPLY_WEAK }; //supply_state, worse as it goes up
+enum { DATE_YEAR, DATE_MONTH, DATE_DAY, DATE_ALARM_DAYS, DATE_MONDAY, DATE_SUNDAY = DATE_MONDAY + 6, DATE_DONE } date_field;
+
+//Scheduled tasks, at most 16
+enum { TASK_RENDER, TASK_BUTTONS, TASK_ALARM, TASK_COUNTDOWN, TASK_SCROLL, TASK_REPEAT, TASK_BLINK, TASK_SIREN, TASK_STACK, TASK_ENERGY, TASK_LIGHT, TASK_SUPPLY, TASK_TELEMETRY, TASKS };
 
 //Declare functions
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 void ioinit (void);
-void delay_ms(uint16_t x); // general purpose delay
-void delay_us(uint16_t x);
 
 void siren(void);
+void siren_next(void);
+void tone_on(void);
+void tone_off(void);
+void render_display(void);
+void post_slot(uint8_t bitmap, uint8_t digit);
+void read_light(void);
 void display_number(uint8_t number, uint8_t digit);
-void display_time(uint16_t time_on);
-void display_alarm_time(uint16_t time_on);
-void clear_display(void);
+void display_time(void);
+void display_alarm_time(void);
 void check_buttons(void);
+void check_show_buttons(uint8_t released);
+void check_set_buttons(uint8_t pressed);
+void check_date_buttons(uint8_t pressed);
+void repeat_button(void);
+void ramp_time(uint8_t *hours_set, uint8_t *minutes_set, uint8_t *ampm_set);
+void blink_display(uint8_t times);
+void stop_blink(void);
+void blink(void);
 void check_alarm(void);
+void check_alarm_switch(void);
+void alarm_switched_off(void);
 
 void update_time_str(void);
-uint8_t append_str(char *dest, char *source);
-uint8_t append_str_P(char *dest, char *source);
-void display_time_str(uint16_t time_on);
+uint8_t append_str_P(char *dest, const char *source);
+void display_time_str(void);
+void scroll_text(void);
 void display_character(uint8_t character, uint8_t position);
+
+void next_day(void);
+uint8_t days_in_month(void);
+uint8_t day_of_week(void);
+uint8_t alarm_days_preset(void);
+void change_date_field(int8_t change);
+void display_date(void);
+
+uint32_t millis(void);
+uint32_t timer_value(void);
+uint32_t countdown_left(void);
+void start_stop_timer(void);
+void reset_timer(void);
+void check_timer(void);
+void check_timer_buttons(uint8_t pressed);
+void display_timer(void);
+
+void start_task(uint8_t task, uint16_t delay, uint16_t period);
+void stop_task(uint8_t task);
+void run_tasks(void);
+
+void paint_stack(void) __attribute__((naked, used, section(".init1")));
+void watchdog_off(void) __attribute__((naked, used, section(".init3")));
+void save_time(void);
+uint8_t saved_check(void);
+uint8_t restore_time(void);
+void clock_tick(void);
+void check_stack(void);
+
+uint8_t segment_count(uint8_t bitmap);
+void count_energy(void);
+void start_energy_save(void);
+void save_energy_byte(void);
+void check_supply(void);
+void send_telemetry(void);
+
+#ifdef TRACE
+static inline void trace_event(uint8_t event) __attribute__((always_inline)); //Inline so the interrupts don't save every register for a call
+#endif
+#ifdef TELEMETRY
+static inline void isr_took(uint8_t source, uint8_t from) __attribute__((always_inline));
+#endif
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 
 //Declare global variables
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-uint8_t hours, minutes, seconds, ampm, flip;
-uint8_t hours_alarm, minutes_alarm, seconds_alarm, ampm_alarm, flip_alarm;
-uint8_t hours_alarm_snooze, minutes_alarm_snooze, seconds_alarm_snooze, ampm_alarm_snooze;
-uint8_t alarm_going;
-uint8_t snooze;
+#define hot (*(volatile struct hot_flags *)&GPIOR0) //See clockit-text.h
+#ifdef __AVR__
+_Static_assert(_SFR_IO_ADDR(GPIOR0) == HOT_FLAGS_IO, "HOT_FLAGS_IO in clockit-text.h isn't GPIOR0");
+#endif
+//GPIOR1 and GPIOR2 are past the bit instructions, but in and out reach them in a cycle
+//where lds and sts take two
+#define program_state GPIOR1 //SHOW_TIME and so on
+#define frame_slot GPIOR2 //Slot the display interrupt lights next
+
+struct flags flags; //See clockit-text.h
+
+uint8_t hours, minutes, seconds, ampm;
+uint8_t hours_alarm, minutes_alarm, ampm_alarm; //Alarms go off on the minute
+uint8_t hours_alarm_snooze, minutes_alarm_snooze, ampm_alarm_snooze;
+uint8_t alarm_switch_reads; //Readings in a row that disagree with alarm_on
 
-char time_str[30];
+uint8_t day, month, year, weekday; //year is years since 2000, weekday is SUNDAY to SATURDAY
+uint8_t alarm_days = ALARM_EVERY_DAY;
+uint8_t alarm_days_choice; //ALARM_DAY_LABELS entry shown while setting the alarm days
+
+volatile uint32_t uptime_seconds; //Seconds since power up, read through millis()
+
+uint32_t timer_start; //millis() when the stopwatch or countdown was last started
+uint32_t timer_elapsed; //ms counted before the last start
+uint8_t countdown_minutes = 5;
+
+char time_str[31]; //The longest is "    Eleven Twenty-Seven AM    " and its 0
 uint8_t time_str_display_index = 0;
-uint8_t scroll_count = 0;
-uint8_t show_time_str = FALSE;
 uint8_t bright_level = BRIGHT;
+
+uint8_t buttons; //PRESS_ bits for the buttons held down
+uint8_t buttons_seen; //Every button pressed since they were all last let go
+uint32_t buttons_since; //millis() when buttons last changed
+uint32_t alarm_shown_since;
+
+uint8_t blinks_left; //Display on/off changes left, or BLINK_FOREVER
+uint8_t siren_step; //0 when quiet
+
+struct slot {
+  uint8_t portc;
+  uint8_t portd;
+};
+
+struct slot frames[2][FRAME_SLOTS]; //Display frames, one shown while the other is built
+volatile uint8_t shown_frame;
+uint8_t frame_pos; //Slot render_display() fills in next
+
+struct task {
+  uint16_t due; //Low 16 bits of millis() when it should run, so at most 65s ahead
+  uint16_t period; //ms between runs, 0 to run once
+};
+
+struct task tasks[TASKS];
+uint16_t wheel[WHEEL_SLOTS]; //TASK_BITs of the tasks due in each ms slot
+uint32_t wheel_time; //ms the wheel has been turned to
+
+extern uint8_t _end; //First byte after .data and .bss, from the linker
+extern uint8_t __stack; //Top of RAM, where the stack starts
+uint16_t stack_free; //Bytes of RAM the stack has never reached since power up
+uint16_t EEMEM stack_free_least = 0xFFFF; //Lowest stack_free of any run, read it from an EEPROM dump
+uint16_t stack_free_lowest; //What stack_free_least should hold, check_stack() writes it a byte at a time
+
+//The time and alarm, saved every second and by the watchdog interrupt. They are in .noinit
+//so a watchdog or brown-out reset leaves them alone and the clock can carry on where it
+//was. At power up the RAM is random, which the checksum catches.
+struct saved {
+  uint8_t hours, minutes, seconds, ampm;
+  uint8_t hours_alarm, minutes_alarm, ampm_alarm;
+  uint8_t hours_alarm_snooze, minutes_alarm_snooze, ampm_alarm_snooze;
+  uint8_t snooze : 1;
+  uint8_t alarm_going : 1;
+  uint8_t time_unsure : 1;
+  uint8_t day, month, year, alarm_days;
+  uint16_t clicks; //TCNT1 at the moment of saving
+  uint8_t check; //saved_check() of everything above
+};
+
+struct saved saved __attribute__((section(".noinit")));
+uint8_t reset_cause __attribute__((section(".noinit"))); //MCUSR from the last reset
+
+struct energy energy; //See clockit-text.h
+struct energy EEMEM energy_saved;
+uint32_t idle_clicks; //Timer 2 clicks slept since count_energy() last ran
+uint32_t lit_clicks; //Segments x Timer 2 on clicks x ms, FRAME_CLICKS of them are a segment ms
+uint8_t frame_segments; //Segments posted to the frame being built
+uint8_t shown_segments; //Segments in the frame being shown
+uint8_t shown_on_clicks; //OCR2B for the frame being shown
+uint16_t shown_since; //wheel_time when the frame being shown went up
+uint32_t tone_since; //wheel_time when the piezo was last turned on
+uint16_t energy_saves_in = ENERGY_SAVE_COUNT;
+struct energy energy_saving; //The energy being written to energy_saved, a byte at a time
+uint8_t energy_save_next = sizeof(struct energy); //Next byte of it to check, sizeof when done
+
+uint16_t light_start; //TCNT1 when the reading started
+volatile uint16_t light_clicks; //Timer 1 clicks the LEDs took to discharge
+uint16_t light_level; //Filtered on time in 1/16 us, 0 before the first reading
+
+uint16_t supply_mv; //VCC at the last reading, 0 before the first
+uint8_t supply_state = SUPPLY_GOOD;
+
+#ifdef TRACE
+struct trace_record trace[TRACE_SIZE];
+uint8_t trace_next;
+#endif
+
+#ifdef TELEMETRY
+//Sent low byte first, as the AVR keeps it
+struct telemetry {
+  uint8_t sync; //TELEMETRY_SYNC
+  uint8_t hours; //With TELEMETRY_PM
+  uint8_t minutes, seconds;
+  uint8_t state; //TELEMETRY_ bits and supply_state
+  uint16_t refresh; //Frames shown in the last TELEMETRY_PERIOD
+  uint16_t stack_free;
+  uint8_t isr_max[TRACE_ISRS]; //Longest each interrupt has taken since power up, in Timer 2 clicks
+  uint8_t check; //Makes the bytes of the record add up to 0
+};
+
+struct telemetry telemetry; //The record being sent
+uint8_t telemetry_next; //Byte of it to send next
+uint16_t telemetry_bits; //Start bit, the byte and the stop bit, sent from bit 0 up
+uint8_t telemetry_bits_left;
+volatile uint8_t isr_max[TRACE_ISRS];
+volatile uint16_t frames_shown;
+uint16_t frames_sent; //frames_shown when the last record was sent
+#endif
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 
 const char num_string_0[] PROGMEM = "Zero";
@@ -231,36 +589,103 @@ const char DIGITS[] PROGMEM = {
   0b10111110, // 9
 };
 
+//Digit pins for digits 1 to 4 and the colon/AM dot (digit 5)
+const uint8_t DIGIT_PINS[] PROGMEM = {
+  DIG_1,
+  DIG_2,
+  DIG_3,
+  DIG_4,
+  COL,
+};
+
 const char PUNCTUATION[] PROGMEM = {
 //0bD0BGACFE
   0b00010000, // -
   0b00100000, // '
 };
 
-ISR (TIMER1_OVF_vect)
-{
-  //Prescalar of 1024
-  //Clock = 16MHz
-  //15,625 clicks per second
-  //64us per click
+//Days in each month of a common year, February gets one more in leap years
+const uint8_t MONTH_DAYS[] PROGMEM = {
+  31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31,
+};
+
+//Month offsets for day_of_week() (Sakamoto's method)
+const uint8_t MONTH_OFFSETS[] PROGMEM = {
+  0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4,
+};
+
+//Alarm day choices offered when setting the date, labelled with ISO weekday numbers (Monday = 1)
+const uint8_t ALARM_DAY_MASKS[ALARM_DAY_PRESETS] PROGMEM = {
+  ALARM_EVERY_DAY,
+  ALARM_WEEKDAYS,
+  ALARM_WEEKENDS,
+};
+
+const char ALARM_DAY_LABELS[ALARM_DAY_PRESETS + 1][4] PROGMEM = {
+  "1-7",
+  "1-5",
+  "6-7",
+  "SEL",
+};
+
+//How holding UP or DOWN moves the time or alarm being set: from held ms after the
+//press, each step moves it on minutes, every period ms. The minutes must divide 60.
+struct ramp {
+  uint16_t held;
+  uint8_t minutes;
+  uint8_t period;
+};
+
+const struct ramp RAMP_CURVE[] PROGMEM = {
+  {    0,  1, 150 },
+  { 1000,  5, 150 },
+  { 2000, 15, 150 },
+  { 3000, 60, 250 },
+};
 
-  TCNT1 = 49911; //65536 - 15,625 = 49,911 - Preload timer 1 for 49,911 clicks. Should be 1s per ISR call
+#define RAMP_STEPS (sizeof(RAMP_CURVE) / sizeof(RAMP_CURVE[0]))
+
+typedef void (*task_function)(void);
+
+const task_function task_functions[TASKS] PROGMEM = {
+  [TASK_RENDER] = render_display,
+  [TASK_BUTTONS] = check_buttons,
+  [TASK_ALARM] = check_alarm,
+  [TASK_COUNTDOWN] = check_timer,
+  [TASK_SCROLL] = scroll_text,
+  [TASK_REPEAT] = repeat_button,
+  [TASK_BLINK] = blink,
+  [TASK_SIREN] = siren_next,
+  [TASK_STACK] = check_stack,
+  [TASK_ENERGY] = count_energy,
+  [TASK_LIGHT] = read_light,
+  [TASK_SUPPLY] = check_supply,
+  [TASK_TELEMETRY] = send_telemetry,
+};
+
+//The second tick. Display interrupts wait while it runs, so it only counts the time and
+//leaves the rest to clock_tick() in the main loop. Budget 200 cycles, see ISR_BUDGETS.
+ISR (TIMER1_COMPA_vect)
+{
+  //Prescalar of 1024 at 16MHz, 256 at 8MHz
+  //15,625 or 31,250 clicks per second
+  //64us or 32us per click
+  //Timer 1 clears itself on the compare match so no clicks are lost to interrupt latency
 
   //Debug with faster time!
-  //TCNT1 = 63581; //65536 - 1,953 = 63581 - Preload timer 1 for 63581 clicks.
-  // Should be 0.125s per ISR call - 8 times faster than normal time
+  //OCR1A = 1952; //1,953 clicks - Should be 0.125s per ISR call - 8 times faster than normal time
 
-  flip_alarm = 1;
+  trace_isr_start(TRACE_SECOND);
 
-  if(flip == 0)
-    flip = 1;
-  else
-    flip = 0;
+  uptime_seconds++;
+  hot.flip_alarm = 1;
+  hot.flip ^= 1;
 
   seconds++;
   if(seconds == 60)
   {
     seconds = 0;
+    hot.new_minute = TRUE;
     minutes++;
     if(minutes == 60)
     {
@@ -272,50 +697,70 @@ ISR (TIMER1_OVF_vect)
         if(ampm == AM)
           ampm = PM;
         else
+        {
           ampm = AM;
+          hot.new_day = TRUE; //Midnight
+        }
       }
 
       if(hours == 13) hours = 1;
     }
+  }
+  hot.ticked = TRUE;
+
+  trace_isr_end(TRACE_SECOND);
+}
+
+//The rest of the second tick, run from the main loop once the interrupt has set hot.ticked
+void clock_tick(void)
+{
+  hot.ticked = FALSE;
+
+  if(hot.new_day)
+  {
+    hot.new_day = FALSE;
+    next_day();
+  }
+
+  if(hot.new_minute)
+  {
+    hot.new_minute = FALSE;
     update_time_str();
   }
+
+#ifndef LIGHT_SENSOR
   if (program_state != SET_TIME) {
     bright_level = (((hours < DIM_BEFORE_HOUR || hours == 12) && ampm == AM) || \
       (hours > BRIGHT_AFTER_HOUR && hours !=12 && ampm == PM)) ? DIM : BRIGHT;
   }
+#endif
+
+  save_time();
 }
 
-ISR (TIMER2_OVF_vect)
+//The main loop has stopped, as the watchdog wasn't reset for 250ms. Save the time as it
+//is now and let the watchdog reset in 15ms. Interrupts stay off until then, so Timer 2
+//can't end the slot that is lit: turn every segment off and deselect every digit first.
+ISR (WDT_vect)
 {
-  if (program_state == SHOW_TIME && show_time_str == TRUE) {
-    display_time_str(10);
-  } else {
-    display_time(10); //Display current time for 1ms
-  }
-
-  if (scroll_count == 10) {
-    scroll_count = 0;
-    time_str_display_index++;
-    if (strlen(time_str) - time_str_display_index < 4) {
-     time_str_display_index = 0;
-    }
-  } else {
-    scroll_count++;
-  }
+  PORTC = 0;
+  PORTD = ALL_DIGITS | (1<<BUT_SNOOZE);
+  save_time();
+  wdt_enable(WDTO_15MS);
+  while(1);
 }
 
 void update_time_str(void)
 {
   uint8_t index = 0;
-  char *spacer = "    ";
-  char *space = " ";
 
-  index += append_str(time_str + index, spacer) - 1;
+  //The words are all in flash, PSTR() keeps the rest there too rather than in .data
+  index += append_str_P(time_str + index, PSTR("    ")) - 1;
   index += append_str_P(time_str + index, (char*)pgm_read_word(&(num_table[hours]))) - 1;
-  index += append_str(time_str + index, space) - 1;
+  index += append_str_P(time_str + index, PSTR(" ")) - 1;
 
   if (minutes == 0) {
-    index += append_str(time_str + index, "O'Clock") - 1;
+    index += append_str_P(time_str + index, PSTR("O'Clock")) - 1;
   } else if (minutes >= 10 && minutes <= 19) {
       index += append_str_P(time_str + index, (char*)pgm_read_word(&(num_table[minutes]))) - 1;
   } else {
@@ -323,736 +768,1412 @@ void update_time_str(void)
     uint8_t ones = minutes % 10;
     index += append_str_P(time_str + index, (char*)pgm_read_word(&(tens_table[tens]))) - 1;
     if(ones != 0) {
-      index += append_str(time_str + index, "-") - 1;
+      index += append_str_P(time_str + index, PSTR("-")) - 1;
       index += append_str_P(time_str + index, (char*)pgm_read_word(&(num_table[ones]))) - 1;
     }
   }
 
   if (ampm == AM) {
-    index += append_str(time_str + index, " AM") - 1;
+    index += append_str_P(time_str + index, PSTR(" AM")) - 1;
   } else {
-    index += append_str(time_str + index, " PM") - 1;
+    index += append_str_P(time_str + index, PSTR(" PM")) - 1;
   }
 
-  index += append_str(time_str + index, spacer) - 1;
+  index += append_str_P(time_str + index, PSTR("    ")) - 1;
   time_str_display_index = 0;
 }
 
-uint8_t append_str(char *dest, char *source)
+//Advance the date by one day. Called from the second tick at midnight,
+//so month lengths come from a table and there are no divisions.
+void next_day(void)
 {
-  uint8_t index = 0;
-  char temp_char;
-  do {
-    temp_char = source[index];
-    dest[index] = temp_char;
-    index++;
-  } while (temp_char != 0);
-  return index;
+  weekday++;
+  if(weekday == 7) weekday = SUNDAY;
+
+  if(day < days_in_month())
+  {
+    day++;
+    return;
+  }
+
+  day = 1;
+  month++;
+  if(month == 13)
+  {
+    month = 1;
+    year++;
+    if(year == 100)
+    {
+      //The calendar only runs to 2099, so 00 is 2000 again and its weekday with it
+      year = 0;
+      weekday = day_of_week();
+    }
+  }
 }
 
-uint8_t append_str_P(char *dest, char *source)
+uint8_t days_in_month(void)
 {
-  uint8_t index = 0;
-  char temp_char;
-  do {
-    temp_char = (char)pgm_read_byte(source + index);
-    dest[index] = temp_char;
-    index++;
-  } while (temp_char != 0);
-  return index;
-}
+  uint8_t days = pgm_read_byte(&MONTH_DAYS[month - 1]);
 
+  //Every fourth year is a leap year between 2000 and 2099
+  if(month == 2 && (year & 0x03) == 0) days++;
 
-int main (void)
-{
-  ioinit(); //Boot up defaults
+  return(days);
+}
 
-  hours = 12;
-  minutes = 00;
-  seconds = 00;
-  ampm = PM;
+//Work out the weekday from scratch, only needed after the date has been set
+uint8_t day_of_week(void)
+{
+  uint16_t y = 2000 + year;
 
-  hours_alarm = 10;
-  minutes_alarm = 00;
-  seconds_alarm = 00;
-  ampm_alarm = AM;
+  if(month < 3) y--;
 
-  hours_alarm_snooze = 12;
-  minutes_alarm_snooze = 00;
-  seconds_alarm_snooze = 00;
-  ampm_alarm_snooze = AM;
-  alarm_going = FALSE;
-  snooze = FALSE;
+  return((y + y/4 - y/100 + y/400 + pgm_read_byte(&MONTH_OFFSETS[month - 1]) + day) % 7);
+}
 
-  update_time_str();
-  sei(); //Enable interrupts
-  siren(); //Make some noise at power up
+//Index of the current alarm_days in ALARM_DAY_MASKS, or ALARM_DAY_PRESETS for days picked one at a time
+uint8_t alarm_days_preset(void)
+{
+  for(uint8_t i = 0 ; i < ALARM_DAY_PRESETS ; i++)
+  {
+    if(pgm_read_byte(&ALARM_DAY_MASKS[i]) == alarm_days) return(i);
+  }
+  return(ALARM_DAY_PRESETS);
+}
 
-  while(1)
+//UP and DOWN in set date mode
+void change_date_field(int8_t change)
+{
+  switch(date_field)
   {
-    check_buttons(); //See if we need to set the time or snooze
-    check_alarm(); //See if the current time is equal to the alarm time
+    case DATE_YEAR:
+      year += change;
+      if(year == 100) year = 0;
+      if(year == 255) year = 99;
+      break;
+    case DATE_MONTH:
+      month += change;
+      if(month == 13) month = 1;
+      if(month == 0) month = 12;
+      break;
+    case DATE_DAY:
+      day += change;
+      if(day > days_in_month()) day = 1;
+      if(day == 0) day = days_in_month();
+      break;
+    case DATE_ALARM_DAYS:
+      alarm_days_choice += change;
+      if(alarm_days_choice == ALARM_DAY_PRESETS + 1) alarm_days_choice = 0;
+      if(alarm_days_choice == 255) alarm_days_choice = ALARM_DAY_PRESETS;
+      if(alarm_days_choice < ALARM_DAY_PRESETS) alarm_days = pgm_read_byte(&ALARM_DAY_MASKS[alarm_days_choice]);
+      break;
+    default:
+      //One of the days after SEL, either button turns it on or off
+      if(date_field >= DATE_MONDAY && date_field <= DATE_SUNDAY)
+        alarm_days ^= 1 << ((date_field - DATE_MONDAY + MONDAY) % 7);
+      break;
   }
-  return(0);
+
+  //Going from a long month to a short one
+  if(day > days_in_month()) day = days_in_month();
 }
 
-//Check to see if the time is equal to the alarm time
-void check_alarm(void)
+//Milliseconds since power up. Built from the seconds count and the Timer 1 clicks
+//into the current second, so it needs no interrupt of its own. Safe to call with
+//interrupts on or off. Wraps after about 49 days, so only compare differences.
+//run_tasks() calls it every time the loop wakes, so it scales the clicks with a
+//16 bit multiply rather than a 32 bit divide.
+uint32_t millis(void)
 {
-  //Check wether the alarm slide switch is on or off
-  if( (PINB & (1<<BUT_ALARM)) != 0)
+  uint32_t secs;
+  uint16_t clicks;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-    if (alarm_going == FALSE)
-    {
-      //Check to see if the time equals the alarm time
-      if( (hours == hours_alarm) && (minutes == minutes_alarm) && \
-          (seconds == seconds_alarm) && (ampm == ampm_alarm) && (snooze == FALSE) )
-      {
-        //Set it off!
-        alarm_going = TRUE;
-      }
+    secs = uptime_seconds;
+    clicks = TCNT1;
 
-      //Check to see if we need to set off the alarm again after a ~9 minute snooze
-      if( (hours == hours_alarm_snooze) && (minutes == minutes_alarm_snooze) && \
-          (seconds == seconds_alarm_snooze) && (ampm == ampm_alarm_snooze) && (snooze == TRUE) )
-      {
-        //Set it off!
-        alarm_going = TRUE;
-      }
-    }
+    //Timer 1 has wrapped but the interrupt hasn't run yet
+    if((TIFR1 & (1<<OCF1A)) && clicks < TIMER1_CLICKS_PER_SECOND / 2) secs++;
   }
-  else
-    alarm_going = FALSE;
+
+  return(secs * 1000 + (uint16_t)(((uint32_t)clicks * (uint16_t)MILLIS_SCALE) >> 16));
 }
 
-//Checks buttons for system settings
-void check_buttons(void)
+//Stopwatch or countdown time counted so far in ms
+uint32_t timer_value(void)
 {
-  uint8_t i;
-  uint8_t sling_shot = 0;
-  uint8_t minute_change = 1;
-  uint8_t previous_button = 0;
+  uint32_t value;
 
-  //If the user hits snooze while alarm is going off, record time so that we can set off alarm again in 9 minutes
-  if ( (PIND & (1<<BUT_SNOOZE)) == 0 && alarm_going == TRUE)
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-    alarm_going = FALSE; //Turn off alarm
-    snooze = TRUE; //But remember that we are in snooze mode, alarm needs to go off again in a few minutes
+    value = timer_elapsed;
+    if(flags.timer_running == TRUE) value += millis() - timer_start;
+  }
 
-    seconds_alarm_snooze = 0;
-    minutes_alarm_snooze = minutes + 9; //Snooze to 9 minutes from now
-    hours_alarm_snooze = hours;
-    ampm_alarm_snooze = ampm;
+  return(value);
+}
 
-    if(minutes_alarm_snooze > 59)
-    {
-      minutes_alarm_snooze -= 60;
-      hours_alarm_snooze++;
+//ms left on the countdown
+uint32_t countdown_left(void)
+{
+  uint32_t total = (uint32_t)countdown_minutes * 60000;
+  uint32_t value = timer_value();
 
-      if(hours_alarm_snooze == 12)
-      {
-        if(ampm_alarm_snooze == AM)
-          ampm_alarm_snooze = PM;
-        else
-          ampm_alarm_snooze = AM;
-      }
+  return((value < total) ? total - value : 0);
+}
 
-      if(hours_alarm_snooze == 13) hours_alarm_snooze = 1;
+void start_stop_timer(void)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    if(flags.timer_running == TRUE)
+    {
+      timer_elapsed += millis() - timer_start;
+      flags.timer_running = FALSE;
+    }
+    else
+    {
+      timer_start = millis();
+      flags.timer_running = TRUE;
     }
-
   }
+}
 
-  // toggle time display
-  if ((PINB & (1<<BUT_DOWN)) == 0 && (PIND & (1<<BUT_SNOOZE)) == 0)
+void reset_timer(void)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-    delay_ms(2000);
-
-    if ((PINB & (1<<BUT_DOWN)) == 0 && (PIND & (1<<BUT_SNOOZE)) == 0)
-    {
-      show_time_str = (show_time_str == TRUE) ? FALSE : TRUE;
-      while((PIND & (1<<BUT_SNOOZE)) == 0) ; //Wait for you to release button
-    }
+    flags.timer_running = FALSE;
+    timer_elapsed = 0;
+    flags.countdown_going = FALSE;
   }
+}
 
-  //Check for set time
-  if ( (PINB & ((1<<BUT_UP)|(1<<BUT_DOWN))) == 0)
+//Stop the countdown and make some noise once it has run out
+void check_timer(void)
+{
+  if(program_state == COUNTDOWN && flags.timer_running == TRUE && countdown_left() == 0)
   {
-    delay_ms(2000);
+    start_stop_timer();
+    flags.countdown_going = TRUE;
+  }
+}
 
-    if ( (PINB & ((1<<BUT_UP)|(1<<BUT_DOWN))) == 0)
-    {
-      //You've been holding up and down for 2 seconds
-      //Set time!
-      program_state = SET_TIME;
-      //siren(); //Make some noise to show that you're setting the time
+//Cooperative scheduler
+//Tasks are run one at a time from the main loop, so they must return quickly and
+//never wait. Waiting tasks are kept on a timer wheel with one slot per ms: a task sits
+//in the slot for the low bits of its due time and runs when the wheel gets to that slot
+//at exactly its due time, so starting or stopping a task is a couple of bit operations.
+
+//Run task in delay ms, then every period ms unless period is 0. Restarts a waiting task.
+void start_task(uint8_t task, uint16_t delay, uint16_t period)
+{
+  stop_task(task);
+
+  if(delay == 0) delay = 1; //Next time round
+
+  tasks[task].due = (uint16_t)wheel_time + delay;
+  tasks[task].period = period;
+  wheel[tasks[task].due & (WHEEL_SLOTS - 1)] |= TASK_BIT(task);
+}
+
+void stop_task(uint8_t task)
+{
+  wheel[tasks[task].due & (WHEEL_SLOTS - 1)] &= ~TASK_BIT(task);
+}
+
+//Turn the wheel up to the current time, running each task as it comes due
+void run_tasks(void)
+{
+  uint32_t now = millis();
 
-      while( (PINB & ((1<<BUT_UP)|(1<<BUT_DOWN))) == 0) //Wait for you to stop pressing the buttons
-        display_time(1000); //Display current time for 1000ms
+  while(wheel_time != now)
+  {
+    wheel_time++;
+
+    uint8_t wheel_slot = wheel_time & (WHEEL_SLOTS - 1);
 
-      while(1)
+    for(uint8_t task = 0 ; task < TASKS ; task++)
+    {
+      if((wheel[wheel_slot] & TASK_BIT(task)) && tasks[task].due == (uint16_t)wheel_time)
       {
-        if ( (PIND & (1<<BUT_SNOOZE)) == 0) //All done!
-        {
-          TIMSK2 = (1<<TOIE2); //Re-enable the timer 2 interrupt
-          for(i = 0 ; i < 3 ; i++)
-          {
-            display_time(250); //Display current time for 100ms
-            clear_display();
-            delay_ms(250);
-          }
-
-          while((PIND & (1<<BUT_SNOOZE)) == 0) ; //Wait for you to release button
-          update_time_str();
-          program_state = SHOW_TIME;
-          break;
-        }
+        wheel[wheel_slot] &= ~TASK_BIT(task);
 
-        if ( (PINB & (1<<BUT_UP)) == 0)
-        {
-          //Ramp minutes faster if we are holding the button
-          //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-          if(previous_button == BUT_UP)
-            sling_shot++;
-          else
-          {
-            sling_shot = 0;
-            minute_change = 1;
-          }
-
-          previous_button = BUT_UP;
-
-          if (sling_shot > 5)
-          {
-            minute_change++;
-            if(minute_change > 30) minute_change = 30;
-            sling_shot = 0;
-          }
-          //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-
-          minutes += minute_change;
-          if (minutes > 59)
-          {
-            minutes -= 60;
-            hours++;
-
-            if(hours == 13) hours = 1;
-
-            if(hours == 12)
-            {
-              if(ampm == AM)
-                ampm = PM;
-              else
-                ampm = AM;
-            }
-          }
-          delay_ms(100);
-        }
-        else if ( (PINB & (1<<BUT_DOWN)) == 0)
-        {
-          //Ramp minutes faster if we are holding the button
-          //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-          if(previous_button == BUT_DOWN)
-            sling_shot++;
-          else
-          {
-            sling_shot = 0;
-            minute_change = 1;
-          }
-
-          previous_button = BUT_DOWN;
-
-          if (sling_shot > 5)
-          {
-            minute_change++;
-            if(minute_change > 30) minute_change = 30;
-            sling_shot = 0;
-          }
-          //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-
-
-          minutes -= minute_change;
-          if(minutes > 60)
-          {
-            minutes = 59;
-            hours--;
-            if(hours == 0) hours = 12;
-
-            if(hours == 11)
-            {
-              if(ampm == AM)
-                ampm = PM;
-              else
-                ampm = AM;
-            }
-          }
-          delay_ms(100);
-        }
-        else
-        {
-          previous_button = 0;
-        }
+        //Reschedule first so the task can stop itself
+        if(tasks[task].period != 0) start_task(task, tasks[task].period, tasks[task].period);
 
-        //clear_display(); //Blink display
-        //delay_ms(100);
+        trace_task_start(task);
+        ((task_function)pgm_read_word(&task_functions[task]))();
+        trace_task_end(task);
       }
     }
   }
+}
 
+#ifdef TRACE
 
-  //Check for set alarm
-  if ( (PIND & (1<<BUT_SNOOZE)) == 0)
-  {
-    TIMSK2 = 0;
-    display_alarm_time(2000);
+//Record an event in the trace. The interrupts trace as well, so the main loop must
+//call this with them off.
+static inline void trace_event(uint8_t event)
+{
+  struct trace_record *record = &trace[trace_next++ & (TRACE_SIZE - 1)];
 
-    if ( (PIND & (1<<BUT_SNOOZE)) == 0)
-    {
-      //You've been holding snooze for 2 seconds
-      //Set alarm time!
+  record->event = event;
+  record->when = TCNT1;
+}
 
-      //Disable the regular display clock interrupt
-      TIMSK2 = 0;
+#endif
 
-      while( (PIND & (1<<BUT_SNOOZE)) == 0) //Wait for you to stop pressing the buttons
-      {
-        clear_display();
-        delay_ms(250);
+#ifdef __AVR__ //The host build in sim/ has no stack to look at
 
-        display_alarm_time(250); //Display current time for 1000ms
-      }
+//Fill the RAM between the data and the top of the stack with STACK_PAINT. Runs from .init1
+//straight after reset, before the C runtime has set anything up, so no C and no ret.
+void paint_stack(void)
+{
+  __asm__ volatile (
+    "  ldi r30, lo8(_end)\n"
+    "  ldi r31, hi8(_end)\n"
+    "  ldi r24, %0\n"
+    "  ldi r25, hi8(__stack)\n"
+    "  rjmp 2f\n"
+    "1: st Z+, r24\n"
+    "2: cpi r30, lo8(__stack)\n"
+    "  cpc r31, r25\n"
+    "  brlo 1b\n"
+    "  breq 1b\n"
+    :: "M" (STACK_PAINT));
+}
 
-      while(1)
-      {
-        display_alarm_time(100); //Display current time for 100ms
+//Count the paint the stack has not written over yet. Anything the interrupts push lands
+//on the same stack, so this covers them too.
+void check_stack(void)
+{
+  uint8_t *paint = &_end;
 
-        if ( (PIND & (1<<BUT_SNOOZE)) == 0) //All done!
-        {
-          for(i = 0 ; i < 4 ; i++)
-          {
-            display_alarm_time(250); //Display current time for 100ms
-            clear_display();
-            delay_ms(250);
-          }
+  while(paint <= &__stack && *paint == STACK_PAINT) paint++;
 
-          while((PIND & (1<<BUT_SNOOZE)) == 0) ; //Wait for you to release button
+  stack_free = paint - &_end;
+  if(stack_free < stack_free_lowest) stack_free_lowest = stack_free;
 
-          TIMSK2 = (1<<TOIE2); //Re-enable the timer 2 interrupt
+  //Only ever goes down, so the EEPROM is written a handful of times. A byte takes 3.4ms
+  //to write and tasks mustn't wait, so start at most one write a run and only once the
+  //last has finished. High byte first: a reset in between leaves it too low, not too high.
+  if(eeprom_is_ready())
+  {
+    uint8_t *least = (uint8_t *)&stack_free_least;
 
-          break;
-        }
+    if(eeprom_read_byte(least + 1) != (uint8_t)(stack_free_lowest >> 8))
+      eeprom_write_byte(least + 1, stack_free_lowest >> 8);
+    else if(eeprom_read_byte(least) != (uint8_t)stack_free_lowest)
+      eeprom_write_byte(least, stack_free_lowest);
+  }
+}
 
-        if ( (PINB & (1<<BUT_UP)) == 0)
-        {
-          //Ramp minutes faster if we are holding the button
-          //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-          if(previous_button == BUT_UP)
-            sling_shot++;
-          else
-          {
-            sling_shot = 0;
-            minute_change = 1;
-          }
-
-          previous_button = BUT_UP;
-
-          if (sling_shot > 5)
-          {
-            minute_change++;
-            if(minute_change > 30) minute_change = 30;
-            sling_shot = 0;
-          }
-          //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-
-          minutes_alarm += minute_change;
-          if (minutes_alarm > 59)
-          {
-            minutes_alarm -= 60;
-            hours_alarm++;
-            if(hours_alarm == 13) hours_alarm = 1;
-
-            if(hours_alarm == 12)
-            {
-              if(ampm_alarm == AM)
-                ampm_alarm = PM;
-              else
-                ampm_alarm = AM;
-            }
-          }
-          //delay_ms(100);
-        }
-        else if ( (PINB & (1<<BUT_DOWN)) == 0)
-        {
-          //Ramp minutes faster if we are holding the button
-          //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-          if(previous_button == BUT_DOWN)
-            sling_shot++;
-          else
-          {
-            sling_shot = 0;
-            minute_change = 1;
-          }
-
-          previous_button = BUT_DOWN;
-
-          if (sling_shot > 5)
-          {
-            minute_change++;
-            if(minute_change > 30) minute_change = 30;
-            sling_shot = 0;
-          }
-          //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-
-          minutes_alarm -= minute_change;
-          if(minutes_alarm > 60)
-          {
-            minutes_alarm = 59;
-            hours_alarm--;
-            if(hours_alarm == 0) hours_alarm = 12;
-
-            if(hours_alarm == 11)
-            {
-              if(ampm_alarm == AM)
-                ampm_alarm = PM;
-              else
-                ampm_alarm = AM;
-            }
-          }
-          //delay_ms(100);
-        }
-        else
-        {
-          previous_button = 0;
-        }
+#else
 
-        //clear_display(); //Blink display
-        //delay_ms(100);
-      }
-    }
-    else
-      TIMSK2 = (1<<TOIE2); //Re-enable the timer 2 interrupt
+void paint_stack(void) {}
+void check_stack(void) {}
 
-  }
+#endif
 
-}
+#ifdef __AVR__
 
-void clear_display(void)
+//After a watchdog reset the watchdog is still on, at 15ms, so turn it off before the C
+//runtime gets going. Runs from .init3, keeping the reset cause for main().
+void watchdog_off(void)
 {
-  PORTC = 0;
-  PORTD &= 0b10000000;
+  reset_cause = MCUSR;
+  MCUSR = 0;
+  wdt_disable();
 }
 
-void display_number(uint8_t number, uint8_t digit)
-{
-  //Set the digit
-  PORTD |= (1<<DIG_1)|(1<<DIG_2)|(1<<DIG_3)|(1<<DIG_4)|(1<<COL);
+#else
 
-  switch(digit)
-  {
-    case 1:
-      PORTD &= ~(1<<DIG_1);//Select Digit 1
-      break;
-    case 2:
-      PORTD &= ~(1<<DIG_2);//Select Digit 2
-      break;
-    case 3:
-      PORTD &= ~(1<<DIG_3);//Select Digit 3
-      break;
-    case 4:
-      PORTD &= ~(1<<DIG_4);//Select Digit 4
-      break;
-    case 5:
-      PORTD &= ~(1<<COL);//Select Digit COL
-      break;
-    default:
-      break;
-  }
+void watchdog_off(void) {}
 
-  PORTC = 0; //Clear all segments
-  PORTD &= ~((1<<2)|(1<<5)); //Clear D segment and decimal point
+#endif
 
-  switch(number)
-  {
-    case 0:
-      PORTC |= 0b00101111; //Segments A, B, C, D, E, F
-      PORTD |= 0b00000100;
-      break;
-    case 1:
-      PORTC |= 0b00100100; //Segments B, C
-      //PORTD |= 0b00000000;
-      break;
-    case 2:
-      PORTC |= 0b00111001; //Segments A, B, D, E, G
-      PORTD |= 0b00000100;
-      break;
-    case 3:
-      PORTC |= 0b00111100; //Segments ABCDG
-      PORTD |= 0b00000100;
-      break;
-    case 4:
-      PORTC |= 0b00110110; //Segments BCGF
-      PORTD |= 0b00000000;
-      break;
-    case 5:
-      PORTC |= 0b00011110; //Segments AFGCD
-      PORTD |= 0b00000100;
-      break;
-    case 6:
-      PORTC |= 0b00011111; //Segments AFGDCE
-      PORTD |= 0b00000100;
-      break;
-    case 7:
-      PORTC |= 0b00101100; //Segments ABC
-      PORTD |= 0b00000000;
-      break;
-    case 8:
-      PORTC |= 0b00111111; //Segments ABCDEFG
-      PORTD |= 0b00000100;
-      break;
-    case 9:
-      PORTC |= 0b00111110; //Segments ABCDFG
-      PORTD |= 0b00000100;
-      break;
+//Copy the time and alarm to saved, run every second and by the watchdog interrupt
+void save_time(void)
+{
+  saved.hours = hours;
+  saved.minutes = minutes;
+  saved.seconds = seconds;
+  saved.ampm = ampm;
+  saved.hours_alarm = hours_alarm;
+  saved.minutes_alarm = minutes_alarm;
+  saved.ampm_alarm = ampm_alarm;
+  saved.hours_alarm_snooze = hours_alarm_snooze;
+  saved.minutes_alarm_snooze = minutes_alarm_snooze;
+  saved.ampm_alarm_snooze = ampm_alarm_snooze;
+  saved.snooze = flags.snooze;
+  saved.alarm_going = hot.alarm_going;
+  saved.time_unsure = flags.time_unsure;
+  saved.day = day;
+  saved.month = month;
+  saved.year = year;
+  saved.alarm_days = alarm_days;
+  saved.clicks = TCNT1;
+  saved.check = saved_check();
+}
 
-    case 10:
-      //Colon
-      PORTC |= 0b00101000; //Segments AB
-      //PORTD |= 0b00000000;
-      break;
+//Rotate and xor, so swapped bytes show up as well as changed ones
+uint8_t saved_check(void)
+{
+  uint8_t *byte = (uint8_t *)&saved;
+  uint8_t check = SAVED_SEED;
 
-    case 11:
-      //Alarm dot
-      PORTD |= 0b00100000;
-      break;
+  for(uint8_t i = 0 ; i < offsetof(struct saved, check) ; i++)
+    check = ((check << 1) | (check >> 7)) ^ byte[i];
+  return(check);
+}
 
-    case 12:
-      //AM dot
-      PORTC |= 0b00000100; //Segments C
-      break;
+//Carry on with the saved time, returns FALSE if there isn't one
+uint8_t restore_time(void)
+{
+  uint16_t clicks;
+
+  if(saved.check != saved_check()) return(FALSE);
+
+  hours = saved.hours;
+  minutes = saved.minutes;
+  seconds = saved.seconds;
+  ampm = saved.ampm;
+  hours_alarm = saved.hours_alarm;
+  minutes_alarm = saved.minutes_alarm;
+  ampm_alarm = saved.ampm_alarm;
+  hours_alarm_snooze = saved.hours_alarm_snooze;
+  minutes_alarm_snooze = saved.minutes_alarm_snooze;
+  ampm_alarm_snooze = saved.ampm_alarm_snooze;
+  flags.snooze = saved.snooze;
+  if(saved.alarm_going) hot.alarm_going = TRUE;
+  flags.time_unsure = saved.time_unsure;
+  day = saved.day;
+  month = saved.month;
+  year = saved.year;
+  alarm_days = saved.alarm_days;
+  weekday = day_of_week();
+
+  //Make up for the reset. After the watchdog that is RESTART_MS from the time saved by its
+  //interrupt, but a brown-out starts from the last second tick or supply step down and
+  //can't know how long the supply was too low, so main() marks that time as unsure.
+  //Writing TCNT1 blocks the next compare match, so stop short of it
+  //and lose a little time in the rare case the reset went past the second tick.
+  clicks = saved.clicks + RESTART_MS * TIMER1_CLICKS_PER_SECOND / 1000;
+  if(clicks > TIMER1_CLICKS_PER_SECOND - 2) clicks = TIMER1_CLICKS_PER_SECOND - 2;
+  TCNT1 = clicks;
+
+  return(TRUE);
+}
 
-    default:
-      PORTC = 0;
-      break;
+//Lit segments in a CHARACTERS or DIGITS bitmap, with SEGMENT_DP for the decimal point
+uint8_t segment_count(uint8_t bitmap)
+{
+  uint8_t count = 0;
+
+  for( ; bitmap != 0 ; bitmap &= bitmap - 1) count++;
+  return(count);
+}
+
+//Fold the counts kept by the main loop and the display into energy, run by TASK_ENERGY
+void count_energy(void)
+{
+  energy.on_ms += ENERGY_PERIOD;
+
+  energy.idle_ms += idle_clicks / CLICKS_PER_MS;
+  idle_clicks %= CLICKS_PER_MS;
+
+  energy.lit_segment_ms += lit_clicks / FRAME_CLICKS;
+  lit_clicks %= FRAME_CLICKS;
+
+  //Only the bytes that have changed get written, an hour apart the EEPROM lasts for years
+  if(--energy_saves_in == 0)
+  {
+    start_energy_save();
+    energy_saves_in = ENERGY_SAVE_COUNT;
   }
+  save_energy_byte();
 }
 
-//Displays current time
-//Brightness level is an amount of time the LEDs will be in - 200us is pretty dim but visible.
-//Amount of time during display is around : [ BRIGHT_LEVEL(us) * 5 + 10ms ] * 10
-//Roughly 11ms * 10 = 110ms
-//Time on is in (ms)
-void display_time(uint16_t time_on)
+//Save energy as it is now, see save_energy_byte()
+void start_energy_save(void)
 {
-  for(uint16_t j = 0 ; j < time_on ; j++)
+  energy_saving = energy;
+  energy_save_next = 0;
+}
+
+//Write the next byte of energy_saving that differs from the EEPROM. A byte takes 3.4ms to
+//write and tasks mustn't wait, so start at most one write a run and only once the last has
+//finished. A reset part way through leaves some counters from the save before.
+void save_energy_byte(void)
+{
+  uint8_t *from = (uint8_t *)&energy_saving;
+  uint8_t *to = (uint8_t *)&energy_saved;
+
+  if(!eeprom_is_ready()) return;
+
+  while(energy_save_next < sizeof(energy_saving))
   {
+    uint8_t i = energy_save_next++;
 
-#ifdef NORMAL_TIME
-    //Display normal hh:mm time
-    if(hours > 9)
+    if(eeprom_read_byte(to + i) != from[i])
     {
-      display_number(hours / 10, 1); //Post to digit 1
-      delay_us(bright_level);
+      eeprom_write_byte(to + i, from[i]);
+      return;
     }
+  }
+}
+
+//Measure VCC and cut the display back as it falls, run by TASK_SUPPLY. With no resistors
+//the segments and the buzzer draw straight from the supply, so a weak one could brown out
+//at BRIGHT with the siren going. Below SUPPLY_LOW_MV the on time is held to SUPPLY_LOW_ON,
+//below SUPPLY_WEAK_MV the display refreshes SUPPLY_SLOW times slower too, and going down
+//a step saves the time and starts saving the energy counters in case the supply goes on
+//falling, a byte a run without waiting on the EEPROM.
+//The ADC compares the bandgap with VCC, so the higher the reading the lower VCC is. The
+//conversion read here was started by the last run and has long finished.
+void check_supply(void)
+{
+  uint16_t reading = ADC;
+  uint8_t state = SUPPLY_GOOD;
 
-    display_number(hours % 10, 2); //Post to digit 2
-    delay_us(bright_level);
+  ADCSRA |= (1<<ADSC); //Start the next one
+  save_energy_byte(); //Every SUPPLY_PERIOD too, so a save started by a step down is done within 4s
 
-    display_number(minutes / 10, 3); //Post to digit 3
-    delay_us(bright_level);
+  if(reading == 0) return;
+  supply_mv = (uint32_t)SUPPLY_BANDGAP_MV * 1024 / reading;
 
-    display_number(minutes % 10, 4); //Post to digit 4
-    delay_us(bright_level);
-#else
-    //During debug, display mm:ss
-    display_number(minutes / 10, 1);
-    delay_us(bright_level);
+  if(supply_mv < SUPPLY_LOW_MV) state = SUPPLY_LOW;
+  if(supply_mv < SUPPLY_WEAK_MV) state = SUPPLY_WEAK;
 
-    display_number(minutes % 10, 2);
-    delay_us(bright_level);
+  //Only go back up once clear of the threshold, so a supply sitting on it doesn't flicker
+  if(state < supply_state &&
+     supply_mv < ((supply_state == SUPPLY_WEAK) ? SUPPLY_WEAK_MV : SUPPLY_LOW_MV) + SUPPLY_HYSTERESIS_MV) return;
+
+  if(state > supply_state)
+  {
+    save_time();
+    start_energy_save();
+  }
 
-    display_number(seconds / 10, 3);
-    delay_us(bright_level);
+  supply_state = state;
+}
 
-    display_number(seconds % 10, 4);
-    delay_us(bright_level);
+uint8_t append_str_P(char *dest, const char *source)
+{
+  uint8_t index = 0;
+  char temp_char;
+  do {
+    temp_char = (char)pgm_read_byte(source + index);
+    dest[index] = temp_char;
+    index++;
+  } while (temp_char != 0);
+  return index;
+}
+
+
+int main (void)
+{
+  uint8_t warm;
+
+  ioinit(); //Boot up defaults
+
+  //After the watchdog or a brown-out carry on with the time from before, without the siren
+  warm = (reset_cause & ((1<<WDRF)|(1<<BORF))) && restore_time();
+  if(warm == TRUE && (reset_cause & (1<<BORF))) flags.time_unsure = TRUE;
+  if(warm == FALSE)
+  {
+    hours = 12;
+    minutes = 00;
+    seconds = 00;
+    ampm = PM;
+
+    day = 1;
+    month = 1;
+    year = 0;
+    weekday = day_of_week();
+
+    hours_alarm = 10;
+    minutes_alarm = 00;
+    ampm_alarm = AM;
+
+    hours_alarm_snooze = 12;
+    minutes_alarm_snooze = 00;
+    ampm_alarm_snooze = AM;
+    hot.alarm_going = FALSE;
+    flags.snooze = FALSE;
+  }
+
+  //How the switch starts out isn't a change, but a snooze from before it went off is over
+  flags.alarm_on = (PINB & (1<<BUT_ALARM)) ? TRUE : FALSE;
+  if(flags.alarm_on == FALSE) alarm_switched_off();
+
+  update_time_str();
+
+  eeprom_read_block(&energy, &energy_saved, sizeof(energy));
+  if(energy.on_ms == 0xFFFFFFFF) memset(&energy, 0, sizeof(energy)); //Never saved
+
+  start_task(TASK_RENDER, 1, RENDER_PERIOD); //Keep the display up to date
+  start_task(TASK_BUTTONS, 1, BUTTON_PERIOD); //See if we need to set the time or snooze
+  start_task(TASK_ALARM, 1, ALARM_PERIOD); //See if the current time is equal to the alarm time
+  start_task(TASK_COUNTDOWN, 1, ALARM_PERIOD); //See if the countdown has run out
+  start_task(TASK_SCROLL, SCROLL_PERIOD, SCROLL_PERIOD); //Scroll the text display
+  stack_free_lowest = eeprom_read_word(&stack_free_least);
+  start_task(TASK_STACK, STACK_PERIOD, STACK_PERIOD); //Keep track of the stack headroom
+  start_task(TASK_ENERGY, ENERGY_PERIOD, ENERGY_PERIOD); //Add up where the power goes
+#ifdef LIGHT_SENSOR
+  start_task(TASK_LIGHT, 100, LIGHT_PERIOD); //Set the brightness from the room light
+#endif
+  start_task(TASK_SUPPLY, SUPPLY_PERIOD, SUPPLY_PERIOD); //Shed load if the supply sags
+#ifdef TELEMETRY
+  sbi(PORTB, TELEMETRY_PIN); //The serial line rests high
+  start_task(TASK_TELEMETRY, TELEMETRY_PERIOD, TELEMETRY_PERIOD); //Report how the clock is doing
 #endif
 
-    //Check whether it is AM or PM and turn on dot
-    if(ampm == AM)
-    {
-      display_number(12, 5); //Turn on dot on digit 3
-      delay_us(bright_level);
-    }
+  //Reset if the main loop stops for 250ms. The watchdog interrupt comes first and saves the time.
+  wdt_reset();
+  WDTCSR = (1<<WDCE)|(1<<WDE);
+  WDTCSR = (1<<WDIE)|(1<<WDE)|(1<<WDP2);
+
+  sei(); //Enable interrupts
+  if(warm == FALSE) siren(); //Make some noise at power up
+
+  while(1)
+  {
+    if(hot.ticked) clock_tick(); //Before the tasks, so they see the new minute and day
+    run_tasks(); //Run anything that is due
+    wdt_reset(); //Still going
+
+    //Nothing to do until the next interrupt, the display wakes us every slot. That is
+    //at most one Timer 2 cycle, so the clicks it moved on are the time spent asleep.
+    uint8_t slept_from = TCNT2;
+    sleep_mode();
+    uint8_t woke_at = TCNT2;
+    uint16_t slept = (woke_at >= slept_from) ? woke_at - slept_from : woke_at + SLOT_CLICKS - slept_from;
+    idle_clicks += (supply_state == SUPPLY_WEAK) ? slept * SUPPLY_SLOW : slept;
+  }
+  return(0);
+}
+
+//Check to see if the time is equal to the alarm time
+void check_alarm(void)
+{
+  check_alarm_switch();
 
-    //Flash colon for each second
-    if(flip == 0 && program_state == SHOW_TIME)
+  if(flags.alarm_on == TRUE)
+  {
+    if (hot.alarm_going == FALSE)
     {
-      display_number(255, 5); //Post to digit COL
+      //Check to see if the time equals the alarm time on one of the alarm days
+      if( (hours == hours_alarm) && (minutes == minutes_alarm) && \
+          (seconds == 0) && (ampm == ampm_alarm) && (flags.snooze == FALSE) && \
+          (alarm_days & (1<<weekday)) )
+      {
+        //Set it off!
+        hot.alarm_going = TRUE;
+      }
+
+      //Check to see if we need to set off the alarm again after a ~9 minute snooze
+      if( (hours == hours_alarm_snooze) && (minutes == minutes_alarm_snooze) && \
+          (seconds == 0) && (ampm == ampm_alarm_snooze) && (flags.snooze == TRUE) )
+      {
+        //Set it off!
+        hot.alarm_going = TRUE;
+      }
     }
-    else
+  }
+}
+
+//Debounce the alarm slide switch, run from check_alarm(). It has to read the same for
+//ALARM_SWITCH_READS in a row to count as moved, and then acts on it just the once.
+void check_alarm_switch(void)
+{
+  uint8_t on = (PINB & (1<<BUT_ALARM)) ? TRUE : FALSE;
+
+  if(on == flags.alarm_on)
+  {
+    alarm_switch_reads = 0;
+    return;
+  }
+
+  if(++alarm_switch_reads < ALARM_SWITCH_READS) return;
+
+  alarm_switch_reads = 0;
+  flags.alarm_on = on;
+  if(flags.alarm_on == FALSE) alarm_switched_off();
+}
+
+void alarm_switched_off(void)
+{
+  hot.alarm_going = FALSE;
+  flags.snooze = FALSE; //If the alarm switch is turned off, this resets the ~9 minute addtional snooze timer
+
+  hours_alarm_snooze = 88; //Set these values high, so that normal time cannot hit the snooze time accidentally
+  minutes_alarm_snooze = 88;
+}
+
+//Checks buttons for system settings
+//Runs every BUTTON_PERIOD ms and never waits, holds are timed from buttons_since
+void check_buttons(void)
+{
+  uint8_t down = ((~PINB) & (PRESS_UP|PRESS_DOWN)) | ((~PIND) & PRESS_SNOOZE);
+  uint8_t pressed = down & ~buttons; //Buttons that have just gone down
+  uint8_t released = 0; //Every button used, once they have all been let go
+
+  if(down != buttons)
+  {
+    buttons = down;
+    buttons_since = millis();
+  }
+  buttons_seen |= buttons;
+
+  if(buttons == 0)
+  {
+    released = buttons_seen;
+    buttons_seen = 0;
+
+    if(flags.wait_release == TRUE)
     {
-      display_number(10, 5); //Post to digit COL
+      //That was the end of a hold, not a press
+      flags.wait_release = FALSE;
+      released = 0;
+      if(blinks_left == BLINK_FOREVER) stop_blink();
     }
-    delay_us(bright_level);
+  }
 
-    //Indicate wether the alarm is on or off
-    if( (PINB & (1<<BUT_ALARM)) != 0)
+  //If the user hits snooze while alarm is going off, record time so that we can set off alarm again in 9 minutes
+  if ( (pressed & PRESS_SNOOZE) && hot.alarm_going == TRUE)
+  {
+    hot.alarm_going = FALSE; //Turn off alarm
+    flags.snooze = TRUE; //But remember that we are in snooze mode, alarm needs to go off again in a few minutes
+
+    minutes_alarm_snooze = minutes + 9; //Snooze to 9 minutes from now
+    hours_alarm_snooze = hours;
+    ampm_alarm_snooze = ampm;
+
+    if(minutes_alarm_snooze > 59)
     {
-      display_number(11, 4); //Turn on dot on digit 4
-      delay_us(bright_level);
+      minutes_alarm_snooze -= 60;
+      hours_alarm_snooze++;
 
-      //If the alarm slide is on, and alarm_going is true, make noise!
-      if(alarm_going == TRUE && flip_alarm == 1)
+      if(hours_alarm_snooze == 12)
       {
-        clear_display();
-        siren();
-        flip_alarm = 0;
+        if(ampm_alarm_snooze == AM)
+          ampm_alarm_snooze = PM;
+        else
+          ampm_alarm_snooze = AM;
       }
-    }
-    else
-    {
-      snooze = FALSE; //If the alarm switch is turned off, this resets the ~9 minute addtional snooze timer
 
-      hours_alarm_snooze = 88; //Set these values high, so that normal time cannot hit the snooze time accidentally
-      minutes_alarm_snooze = 88;
-      seconds_alarm_snooze = 88;
+      if(hours_alarm_snooze == 13) hours_alarm_snooze = 1;
     }
 
-    clear_display();
-    delay_us(bright_level);
+    if(program_state == STOPWATCH || program_state == COUNTDOWN)
+      pressed &= ~PRESS_SNOOZE; //Don't stop the timer as well
+  }
+
+  if(flags.wait_release == TRUE || blinks_left != 0) return;
+
+  switch(program_state)
+  {
+    case SET_TIME:
+    case SET_ALARM:
+      check_set_buttons(pressed);
+      break;
+    case SET_DATE:
+      check_date_buttons(pressed);
+      break;
+    case STOPWATCH:
+    case COUNTDOWN:
+      check_timer_buttons(pressed);
+      break;
+    default:
+      check_show_buttons(released);
+      break;
   }
 }
 
-//Displays current alarm time
-//Brightness level is an amount of time the LEDs will be in - 200us is pretty dim but visible.
-//Amount of time during display is around : [ BRIGHT_LEVEL(us) * 5 + 10ms ] * 10
-//Roughly 11ms * 10 = 110ms
-//Time on is in (ms)
-void display_alarm_time(uint16_t time_on)
+//Buttons while showing the time or alarm time
+//Hold a combination for 2 seconds to change a setting
+void check_show_buttons(uint8_t released)
 {
-  for(uint16_t j = 0 ; j < time_on ; j++)
+  uint8_t held_long = (millis() - buttons_since >= HOLD_TIME) ? TRUE : FALSE;
+
+  //Check for set alarm
+  if (buttons == PRESS_SNOOZE)
   {
-    //Display normal hh:mm time
-    if(hours_alarm > 9)
+    if (program_state == SHOW_TIME)
     {
-      display_number(hours_alarm / 10, 1); //Post to digit 1
-      delay_us(bright_level);
+      program_state = SHOW_ALARM; //Show the alarm time for at least 2 seconds
+      alarm_shown_since = millis();
+    }
+    else if (held_long == TRUE)
+    {
+      //You've been holding snooze for 2 seconds
+      //Set alarm time!
+      program_state = SET_ALARM;
+      flags.wait_release = TRUE;
+      blink_display(BLINK_FOREVER); //Blink until you stop pressing the button
     }
+    return;
+  }
 
-    display_number(hours_alarm % 10, 2); //Post to digit 2
-    delay_us(bright_level);
+  if (program_state == SHOW_ALARM && millis() - alarm_shown_since >= HOLD_TIME)
+    program_state = SHOW_TIME;
 
-    display_number(minutes_alarm / 10, 3); //Post to digit 3
-    delay_us(bright_level);
+  // toggle time display
+  if (buttons == (PRESS_DOWN|PRESS_SNOOZE) && held_long == TRUE)
+  {
+    if(hot.show_time_str == TRUE)
+      hot.show_time_str = FALSE;
+    else
+      hot.show_time_str = TRUE;
+    program_state = SHOW_TIME;
+    flags.wait_release = TRUE;
+  }
 
-    display_number(minutes_alarm % 10, 4); //Post to digit 4
-    delay_us(bright_level);
+  //Check for set date
+  if (buttons == (PRESS_UP|PRESS_SNOOZE) && held_long == TRUE)
+  {
+    //You've been holding up and snooze for 2 seconds
+    //Set date!
+    program_state = SET_DATE;
+    date_field = DATE_YEAR;
+    flags.wait_release = TRUE;
+  }
 
+  //Check for set time
+  if (buttons == (PRESS_UP|PRESS_DOWN) && held_long == TRUE)
+  {
+    //You've been holding up and down for 2 seconds
+    //Set time!
+    program_state = SET_TIME;
+    flags.wait_release = TRUE;
+  }
 
-    //During debug, display mm:ss
-    /*display_number(minutes_alarm / 10, 1);
-    delay_us(bright_level);
+  //Press UP on its own to go to the stopwatch
+  if (released == PRESS_UP)
+  {
+    reset_timer();
+    program_state = STOPWATCH;
+  }
+}
 
-    display_number(minutes_alarm % 10, 2);
-    delay_us(bright_level);
+//Buttons while setting the time or alarm
+void check_set_buttons(uint8_t pressed)
+{
+  if (pressed & PRESS_SNOOZE) //All done!
+  {
+    stop_task(TASK_REPEAT);
+    flags.wait_release = TRUE;
+    if (program_state == SET_TIME) flags.time_unsure = FALSE;
+    blink_display((program_state == SET_TIME) ? 3 : 4);
+  }
+  else if (pressed & (PRESS_UP|PRESS_DOWN))
+  {
+    //Change straight away, ramp_time() then keeps it changing while the button is held
+    repeat_button();
+  }
+}
 
-    display_number(seconds_alarm / 10, 3);
-    delay_us(bright_level);
+//Buttons while setting the date
+void check_date_buttons(uint8_t pressed)
+{
+  if (pressed & PRESS_SNOOZE) //On to the next field
+  {
+    stop_task(TASK_REPEAT);
+    date_field++;
 
-    display_number(seconds_alarm % 10, 4);
-    delay_us(bright_level);
+    if (date_field == DATE_ALARM_DAYS) alarm_days_choice = alarm_days_preset();
+    if (date_field == DATE_MONDAY && alarm_days_choice != ALARM_DAY_PRESETS) date_field = DATE_DONE; //A preset, no days to pick
 
-    display_number(10, 5); //Display colon
-    delay_us(bright_level);*/
+    if (date_field == DATE_DONE)
+    {
+      weekday = day_of_week();
+      program_state = SHOW_TIME;
+    }
+  }
+  else if (pressed & (PRESS_UP|PRESS_DOWN))
+  {
+    repeat_button();
+    if (date_field < DATE_MONDAY) start_task(TASK_REPEAT, DATE_REPEAT_PERIOD, DATE_REPEAT_PERIOD); //Days only flip once a press
+  }
+}
 
+//Buttons while the stopwatch or countdown is showing
+void check_timer_buttons(uint8_t pressed)
+{
+  if (pressed & PRESS_SNOOZE)
+  {
+    if(flags.countdown_going == TRUE)
+      reset_timer(); //Silence the countdown
+    else
+      start_stop_timer();
+  }
 
-    //Check whether it is AM or PM and turn on dot
-    if(ampm_alarm == AM)
+  if (pressed & PRESS_DOWN)
+  {
+    if(program_state == COUNTDOWN && flags.timer_running == FALSE && timer_value() == 0)
     {
-      display_number(12, 5); //Turn on dot on digit 3
-      delay_us(bright_level);
+      countdown_minutes++;
+      if(countdown_minutes > 99) countdown_minutes = 1;
     }
+    else if(flags.timer_running == FALSE)
+      reset_timer();
+  }
 
-    display_number(10, 5); //Post to digit COL
-    delay_us(bright_level);
+  if (pressed & PRESS_UP)
+  {
+    reset_timer();
+    program_state = (program_state == STOPWATCH) ? COUNTDOWN : SHOW_TIME;
+    flags.wait_release = TRUE; //Don't count letting go of UP as a press in the new mode
+  }
+}
 
-    clear_display();
-    delay_ms(1);
+//Keeps changing the setting while UP or DOWN is held, run by TASK_REPEAT
+void repeat_button(void)
+{
+  if (program_state == SET_TIME)
+    ramp_time(&hours, &minutes, &ampm);
+  else if (program_state == SET_ALARM)
+    ramp_time(&hours_alarm, &minutes_alarm, &ampm_alarm);
+  else if ( (PINB & (1<<BUT_UP)) == 0)
+    change_date_field(1);
+  else if ( (PINB & (1<<BUT_DOWN)) == 0)
+    change_date_field(-1);
+  else
+    stop_task(TASK_REPEAT);
+}
+
+//Steps the time or alarm being set while UP or DOWN is held, and schedules the next step.
+//The steps grow along RAMP_CURVE with the time since the press, going to the next
+//multiple of the step so the fast steps land on round times.
+void ramp_time(uint8_t *hours_set, uint8_t *minutes_set, uint8_t *ampm_set)
+{
+  uint32_t held = millis() - buttons_since;
+  uint8_t step = 0;
+  uint8_t change;
+  uint16_t minute; //Minutes since midnight
+
+  while(step + 1 < RAMP_STEPS && held >= pgm_read_word(&RAMP_CURVE[step + 1].held)) step++;
+  change = pgm_read_byte(&RAMP_CURVE[step].minutes);
+
+  minute = (*hours_set % 12) * 60 + *minutes_set;
+  if(*ampm_set == PM) minute += 12 * 60;
+
+  if ( (PINB & (1<<BUT_UP)) == 0)
+  {
+    minute = (minute / change + 1) * change;
+    if(minute >= 24 * 60) minute -= 24 * 60;
+  }
+  else if ( (PINB & (1<<BUT_DOWN)) == 0)
+  {
+    if(minute == 0) minute = 24 * 60;
+    minute = (minute - 1) / change * change;
+  }
+  else
+  {
+    stop_task(TASK_REPEAT);
+    return;
   }
 
+  *minutes_set = minute % 60;
+  minute /= 60;
+  *ampm_set = (minute >= 12) ? PM : AM;
+  *hours_set = (minute % 12 == 0) ? 12 : minute % 12;
+
+  start_task(TASK_REPEAT, pgm_read_byte(&RAMP_CURVE[step].period), 0);
 }
 
-void display_time_str(uint16_t time_on)
+//Blink the display on and off every BLINK_PERIOD ms, times times
+//or until stop_blink() for BLINK_FOREVER, which starts with the display off
+void blink_display(uint8_t times)
 {
-  for(uint16_t j = 0 ; j < time_on ; j++)
+  if(times == BLINK_FOREVER)
+  {
+    blinks_left = BLINK_FOREVER;
+    flags.display_blank = TRUE;
+  }
+  else
   {
-    display_character(time_str[time_str_display_index], 1);
-    delay_us(bright_level);
+    blinks_left = times * 2;
+    flags.display_blank = FALSE;
+  }
 
-    display_character(time_str[time_str_display_index + 1], 2);
-    delay_us(bright_level);
+  start_task(TASK_BLINK, BLINK_PERIOD, BLINK_PERIOD);
+}
 
-    display_character(time_str[time_str_display_index + 2], 3);
-    delay_us(bright_level);
+void stop_blink(void)
+{
+  stop_task(TASK_BLINK);
+  blinks_left = 0;
+  flags.display_blank = FALSE;
+}
 
-    display_character(time_str[time_str_display_index + 3], 4);
-    delay_us(bright_level);
+//Run by TASK_BLINK. Counted blinks mean a setting is done, so go back to the time afterwards
+void blink(void)
+{
+  flags.display_blank = (flags.display_blank == TRUE) ? FALSE : TRUE;
 
-    //Indicate wether the alarm is on or off
-    if( (PINB & (1<<BUT_ALARM)) != 0)
-    {
-      display_number(11, 4); //Turn on dot on digit 4
-      delay_us(bright_level);
+  if(blinks_left == BLINK_FOREVER) return;
 
-      //If the alarm slide is on, and alarm_going is true, make noise!
-      if(alarm_going == TRUE && flip_alarm == 1)
-      {
-        clear_display();
-        siren();
-        flip_alarm = 0;
-      }
-    }
-    else
+  blinks_left--;
+  if(blinks_left == 0)
+  {
+    stop_blink();
+
+    if(program_state == SET_TIME) update_time_str();
+    program_state = SHOW_TIME;
+  }
+}
+
+//Display multiplexing
+//Timer 2 splits each frame into FRAME_SLOTS slots of 128us. The compare A match lights
+//the next slot's digit and the compare B match turns it off again bright_level us later.
+//render_display() fills in the frame that isn't being shown and then swaps them over.
+//Any other interrupt holds up the slot timing and so the brightness, which at DIM is
+//just 1us, so the interrupts are kept short and ISR_BUDGETS in the Makefile sets how
+//many cycles each may take. make bench checks them, for builds without TRACE.
+
+//Light the next slot. Budget 80 cycles.
+ISR (TIMER2_COMPA_vect)
+{
+  uint8_t next = frame_slot;
+  struct slot *slot = &frames[shown_frame][next];
+
+  trace_isr_start(TRACE_SLOT);
+
+  PORTD = slot->portd; //Includes the snooze pull-up
+  PORTC = slot->portc;
+
+  next++;
+  if(next == FRAME_SLOTS)
+  {
+    next = 0;
+#ifdef TELEMETRY
+    frames_shown++;
+#endif
+  }
+  frame_slot = next;
+
+  trace_isr_end(TRACE_SLOT);
+}
+
+//Turn the slot off again, with every digit selected and no segments lit. The snooze
+//pull-up is the only other pin on PORTD and is always on. Budget 19 cycles.
+#if defined(__AVR__) && !defined(TRACE) && !defined(TELEMETRY)
+
+//Written out by hand so the only thing to save is r24. ldi and out leave SREG alone.
+//From the vector to the end of reti: jmp 3, push 2, ldi out ldi out 4, pop 2, reti 4,
+//15 cycles. The compiler's version also saves r0, r1 and SREG, another 12 or so.
+ISR (TIMER2_COMPB_vect, ISR_NAKED)
+{
+  __asm__ volatile (
+    "  push r24\n"
+    "  ldi r24, 0\n"
+    "  out %0, r24\n"
+    "  ldi r24, %2\n"
+    "  out %1, r24\n"
+    "  pop r24\n"
+    "  reti\n"
+    :: "I" (_SFR_IO_ADDR(PORTC)), "I" (_SFR_IO_ADDR(PORTD)), "M" (1<<BUT_SNOOZE));
+}
+
+#else
+
+ISR (TIMER2_COMPB_vect)
+{
+  trace_isr_start(TRACE_DARK);
+
+  PORTC = 0; //Clear all segments
+  PORTD = (1<<BUT_SNOOZE);
+
+  trace_isr_end(TRACE_DARK);
+}
+
+#endif
+
+//Build the next frame for the current mode, run by TASK_RENDER
+void render_display(void)
+{
+  uint16_t on_clicks = bright_level * CLICKS_PER_US;
+  uint8_t dark_portd = ALL_DIGITS | (1<<BUT_SNOOZE);
+
+  if(on_clicks > MAX_ON_CLICKS) on_clicks = MAX_ON_CLICKS;
+  if(supply_state != SUPPLY_GOOD && on_clicks > SUPPLY_LOW_ON * CLICKS_PER_US) on_clicks = SUPPLY_LOW_ON * CLICKS_PER_US;
+
+  //On a weak supply the slots are SUPPLY_SLOW times as long, each lit for the same time.
+  //OCR2B then counts slower clicks and on_clicks is charged as that much less per slot.
+  if(supply_state == SUPPLY_WEAK)
+  {
+    on_clicks /= SUPPLY_SLOW;
+    if(on_clicks == 0) on_clicks = 1;
+    TCCR2B = TIMER2_SLOW_CS;
+  }
+  else
+    TCCR2B = TIMER2_CS;
+
+  //Charge the frame that has been up since the last render for the time it was shown
+  lit_clicks += (uint32_t)shown_segments * shown_on_clicks * (uint16_t)((uint16_t)wheel_time - shown_since);
+  shown_since = wheel_time;
+
+  OCR2B = on_clicks;
+
+  frame_pos = 0;
+  frame_segments = 0;
+
+  if (flags.light_sensing == TRUE && hot.light_read == FALSE) {
+    //Dark while the LEDs are read, with no pull-up on DIG_4
+    dark_portd &= ~(1<<DIG_4);
+  } else if (flags.display_blank == TRUE) {
+    //Blinking
+  } else if (program_state == SHOW_TIME && hot.show_time_str == TRUE) {
+    display_time_str();
+  } else if (program_state == SET_DATE) {
+    display_date();
+  } else if (program_state == STOPWATCH || program_state == COUNTDOWN) {
+    display_timer();
+  } else if (program_state == SHOW_ALARM || program_state == SET_ALARM) {
+    display_alarm_time();
+  } else {
+    display_time();
+  }
+
+  //The rest of the frame stays dark
+  while(frame_pos < FRAME_SLOTS)
+  {
+    frames[shown_frame ^ 1][frame_pos].portc = 0;
+    frames[shown_frame ^ 1][frame_pos].portd = dark_portd;
+    frame_pos++;
+  }
+
+  shown_frame ^= 1;
+  shown_segments = frame_segments;
+  shown_on_clicks = on_clicks;
+}
+
+//Adds a slot to the frame being built
+//Bitmap is 0bD0BGACFE like CHARACTERS and DIGITS, with SEGMENT_DP for the decimal point
+void post_slot(uint8_t bitmap, uint8_t digit)
+{
+  struct slot *slot;
+
+  if(frame_pos == FRAME_SLOTS) return;
+  slot = &frames[shown_frame ^ 1][frame_pos++];
+
+  frame_segments += segment_count(bitmap);
+
+  slot->portc = bitmap & 0b00111111;
+  slot->portd = (ALL_DIGITS & ~(1<<pgm_read_byte(&DIGIT_PINS[digit - 1]))) | (1<<BUT_SNOOZE); //Select the digit, keep the pull-up on
+
+  if(bitmap & SEGMENT_D) slot->portd |= (1<<SEG_D);
+  if(bitmap & SEGMENT_DP) slot->portd |= (1<<DP);
+}
+
+#ifdef LIGHT_SENSOR
+
+//The LEDs of digit 4 have discharged, see read_light(). Budget 80 cycles.
+ISR (PCINT2_vect)
+{
+  uint16_t clicks;
+
+  trace_isr_start(TRACE_LIGHT);
+
+  if((PIND & (1<<DIG_4)) == 0) //Only the fall counts
+  {
+    clicks = TCNT1 - light_start;
+    if(clicks > TIMER1_CLICKS_PER_SECOND) clicks += TIMER1_CLICKS_PER_SECOND; //Timer 1 went round
+    light_clicks = clicks;
+
+    PCICR = 0;
+    sbi(DDRD, DIG_4); //Back to driving the digit
+    hot.light_read = TRUE;
+  }
+
+  trace_isr_end(TRACE_LIGHT);
+}
+
+#endif
+
+//Read the room light with the LEDs of digit 4 and set bright_level from it, run by TASK_LIGHT.
+//Driving the digit pin high with every segment low charges the LEDs up backwards. Left to
+//float, the light falling on them discharges them again, faster the brighter it is, and
+//PCINT2 times how long the pin takes to read low. The display is dark until then, or for
+//LIGHT_MAX_MS in a dark room. The next run LIGHT_MAX_MS later picks up the result.
+void read_light(void)
+{
+  uint16_t on_us = DIM; //A dark room, the LEDs never discharged
+  uint32_t discharge_us;
+
+  if(flags.light_sensing == FALSE)
+  {
+    flags.light_sensing = TRUE;
+    hot.light_read = FALSE;
+    render_display(); //Show the dark frame now rather than at the next render
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
-      snooze = FALSE; //If the alarm switch is turned off, this resets the ~9 minute addtional snooze timer
-      hours_alarm_snooze = 88; //Set these values high, so that normal time cannot hit the snooze time accidentally
-      minutes_alarm_snooze = 88;
-      seconds_alarm_snooze = 88;
+      PORTC = 0;
+      PORTD = (1<<BUT_SNOOZE)|(1<<DIG_4); //Segments low, digit 4 high
+      cbi(DDRD, DIG_4); //Let it float...
+      cbi(PORTD, DIG_4); //...without the pull-up
+      light_start = TCNT1;
+
+      PCIFR = (1<<PCIF2);
+      PCMSK2 = (1<<PCINT22); //DIG_4 on PD6
+      PCICR = (1<<PCIE2);
     }
 
-    clear_display();
-    delay_us(bright_level);
+    start_task(TASK_LIGHT, LIGHT_MAX_MS, LIGHT_PERIOD);
+    return;
+  }
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    PCICR = 0;
+    sbi(DDRD, DIG_4);
+  }
+  flags.light_sensing = FALSE;
+
+  if(hot.light_read)
+  {
+    discharge_us = (uint32_t)light_clicks * 1000000 / TIMER1_CLICKS_PER_SECOND;
+    if(discharge_us <= LIGHT_SCALE / LIGHT_MAX_ON)
+      on_us = LIGHT_MAX_ON;
+    else
+      on_us = LIGHT_SCALE / discharge_us;
+    if(on_us < DIM) on_us = DIM;
   }
+
+  //Move a quarter of the way each reading, so a shadow or a flickering lamp doesn't
+  //change the brightness in one go
+  if(light_level == 0)
+    light_level = on_us * 16;
+  else
+    light_level += ((int16_t)(on_us * 16) - (int16_t)light_level) / 4;
+
+  bright_level = (light_level + 8) / 16;
 }
 
-void display_character(uint8_t character, uint8_t position)
+//Moves the text display on a character, run by TASK_SCROLL
+void scroll_text(void)
+{
+  time_str_display_index++;
+  if (strlen(time_str) - time_str_display_index < 4) {
+   time_str_display_index = 0;
+  }
+}
+
+void display_number(uint8_t number, uint8_t digit)
 {
-  //Set the digit
-  PORTD |= (1<<DIG_1)|(1<<DIG_2)|(1<<DIG_3)|(1<<DIG_4)|(1<<COL);
+  uint8_t bitmap;
 
-  switch(position)
+  switch(number)
   {
-    case 1:
-      PORTD &= ~(1<<DIG_1);//Select Digit 1
-      break;
-    case 2:
-      PORTD &= ~(1<<DIG_2);//Select Digit 2
-      break;
-    case 3:
-      PORTD &= ~(1<<DIG_3);//Select Digit 3
+    case 10:
+      //Colon
+      bitmap = 0b00101000; //Segments AB
       break;
-    case 4:
-      PORTD &= ~(1<<DIG_4);//Select Digit 4
+
+    case 11:
+      //Alarm dot
+      bitmap = SEGMENT_DP;
       break;
-    case 5:
-      PORTD &= ~(1<<COL);//Select Digit COL
+
+    case 12:
+      //AM dot
+      bitmap = 0b00000100; //Segments C
       break;
+
     default:
+      bitmap = (number < 10) ? pgm_read_byte(&DIGITS[number]) : 0;
       break;
   }
 
-  PORTC = 0; //Clear all segments
-  PORTD &= ~((1<<2)|(1<<5)); //Clear D segment and decimal point
+  post_slot(bitmap, digit);
+}
+
+//Displays current time
+void display_time(void)
+{
+#ifdef NORMAL_TIME
+  //Display normal hh:mm time
+  if(hours > 9)
+  {
+    display_number(hours / 10, 1); //Post to digit 1
+  }
+
+  display_number(hours % 10, 2); //Post to digit 2
+  display_number(minutes / 10, 3); //Post to digit 3
+  display_number(minutes % 10, 4); //Post to digit 4
+#else
+  //During debug, display mm:ss
+  display_number(minutes / 10, 1);
+  display_number(minutes % 10, 2);
+  display_number(seconds / 10, 3);
+  display_number(seconds % 10, 4);
+#endif
+
+  if(flags.time_unsure == TRUE) display_number(11, 2); //Dot on digit 2 until the time is set
+
+  //Check whether it is AM or PM and turn on dot
+  if(ampm == AM)
+  {
+    display_number(12, 5); //Turn on dot on digit 3
+  }
+
+  //Flash colon for each second
+  if(hot.flip == 0 && program_state == SHOW_TIME)
+  {
+    display_number(255, 5); //Post to digit COL
+  }
+  else
+  {
+    display_number(10, 5); //Post to digit COL
+  }
+
+  //Indicate wether the alarm is on or off
+  if(flags.alarm_on == TRUE)
+  {
+    display_number(11, 4); //Turn on dot on digit 4
+
+    //If the alarm slide is on, and alarm_going is true, make noise!
+    if(hot.alarm_going == TRUE && hot.flip_alarm == 1)
+    {
+      siren();
+      hot.flip_alarm = 0;
+    }
+  }
+}
+
+//Displays current alarm time
+void display_alarm_time(void)
+{
+  //Display normal hh:mm time
+  if(hours_alarm > 9)
+  {
+    display_number(hours_alarm / 10, 1); //Post to digit 1
+  }
+
+  display_number(hours_alarm % 10, 2); //Post to digit 2
+  display_number(minutes_alarm / 10, 3); //Post to digit 3
+  display_number(minutes_alarm % 10, 4); //Post to digit 4
+
+  //Check whether it is AM or PM and turn on dot
+  if(ampm_alarm == AM)
+  {
+    display_number(12, 5); //Turn on dot on digit 3
+  }
+
+  display_number(10, 5); //Post to digit COL
+}
+
+void display_time_str(void)
+{
+  display_character(time_str[time_str_display_index], 1);
+  display_character(time_str[time_str_display_index + 1], 2);
+  display_character(time_str[time_str_display_index + 2], 3);
+  display_character(time_str[time_str_display_index + 3], 4);
+
+  if(flags.time_unsure == TRUE) display_number(11, 2); //Dot on digit 2 until the time is set
+
+  //Indicate wether the alarm is on or off
+  if(flags.alarm_on == TRUE)
+  {
+    display_number(11, 4); //Turn on dot on digit 4
+
+    //If the alarm slide is on, and alarm_going is true, make noise!
+    if(hot.alarm_going == TRUE && hot.flip_alarm == 1)
+    {
+      siren();
+      hot.flip_alarm = 0;
+    }
+  }
+}
+
+//Displays the date field being set
+//Year shows as 20yy, month and day as mm dd with a dot after the field being changed
+//and the alarm days as one of the ALARM_DAY_LABELS, then each picked day as its number and on or of
+void display_date(void)
+{
+  if(date_field == DATE_YEAR)
+  {
+    display_number(2, 1);
+    display_number(0, 2);
+    display_number(year / 10, 3);
+    display_number(year % 10, 4);
+  }
+  else if(date_field == DATE_ALARM_DAYS)
+  {
+    const char *label = ALARM_DAY_LABELS[alarm_days_choice];
+
+    for(uint8_t i = 0 ; i < 3 ; i++)
+    {
+      display_character(pgm_read_byte(label + i), i + 1);
+    }
+  }
+  else if(date_field >= DATE_MONDAY)
+  {
+    uint8_t iso_day = date_field - DATE_MONDAY + MONDAY;
+
+    display_number(iso_day, 1);
+    display_character('o', 3);
+    display_character((alarm_days & (1 << (iso_day % 7))) ? 'n' : 'f', 4);
+  }
+  else
+  {
+    display_number(month / 10, 1);
+    display_number(month % 10, 2);
+    display_number(day / 10, 3);
+    display_number(day % 10, 4);
+    display_number(11, (date_field == DATE_MONTH) ? 2 : 4); //Dot after the field being changed
+  }
+}
+
+//Displays the stopwatch or countdown
+//Under a minute shows seconds and hundredths as ss.hh, after that mm:ss
+void display_timer(void)
+{
+  uint32_t hundredths;
+  uint8_t high, low;
 
+  if(program_state == COUNTDOWN)
+    hundredths = (countdown_left() + 9) / 10; //Round up so 00.00 means it has run out
+  else
+    hundredths = timer_value() / 10;
+
+  if(hundredths < 6000)
+  {
+    high = hundredths / 100;
+    low = hundredths % 100;
+  }
+  else
+  {
+    uint32_t secs = hundredths / 100;
+    high = (secs / 60) % 100;
+    low = secs % 60;
+  }
+
+  display_number(high / 10, 1); //Post to digit 1
+  display_number(high % 10, 2); //Post to digit 2
+  display_number(low / 10, 3); //Post to digit 3
+  display_number(low % 10, 4); //Post to digit 4
+
+  if(hundredths < 6000)
+    display_number(11, 2); //Dot between seconds and hundredths
+  else
+    display_number(10, 5); //Colon between minutes and seconds
+
+  //Countdown has run out or the alarm is going off, make noise!
+  if((flags.countdown_going == TRUE || hot.alarm_going == TRUE) && hot.flip_alarm == 1)
+  {
+    siren();
+    hot.flip_alarm = 0;
+  }
+}
+
+void display_character(uint8_t character, uint8_t position)
+{
   const char* base_address;
   if (character >= 'A' && character <= 'Z') {
     base_address = CHARACTERS - 'A';
@@ -1065,104 +2186,202 @@ void display_character(uint8_t character, uint8_t position)
   } else if (character == '\'') {
     base_address = PUNCTUATION - character + 1;
   } else {
+    post_slot(0, position);
     return;
   }
 
-  uint8_t character_bitmap = pgm_read_byte(base_address + character);
-
-  PORTC |= character_bitmap;
-  if (character_bitmap >> 7) {
-    PORTD |= 0b00000100;
-  }
+  post_slot(pgm_read_byte(base_address + character), position);
 }
 
-//Make noise for time_on in (ms)
+//Make some noise: 300ms of tone, a 50ms gap and another 300ms
+//The tone comes from the Timer 0 interrupt, so this returns straight away
 void siren(void)
 {
+  if(siren_step != 0) return; //Already going
 
-  for(int i = 0 ; i < 500 ; i++)
-  {
-    cbi(PORTB, BUZZ1);
-    sbi(PORTB, BUZZ2);
-    delay_us(300);
+  siren_step = 1;
+  tone_on();
+  start_task(TASK_SIREN, SIREN_ON_TIME, 0);
+}
+
+//Next part of the siren, run by TASK_SIREN
+void siren_next(void)
+{
+  siren_step++;
 
-    sbi(PORTB, BUZZ1);
-    cbi(PORTB, BUZZ2);
-    delay_us(300);
+  switch(siren_step)
+  {
+    case 2:
+      tone_off();
+      start_task(TASK_SIREN, SIREN_GAP_TIME, 0);
+      break;
+    case 3:
+      tone_on();
+      start_task(TASK_SIREN, SIREN_ON_TIME, 0);
+      break;
+    default:
+      tone_off();
+      siren_step = 0;
+      break;
   }
+}
 
-  cbi(PORTB, BUZZ1);
-  cbi(PORTB, BUZZ2);
+void tone_on(void)
+{
+  tone_since = wheel_time;
 
-  delay_ms(50);
+  cbi(PORTB, BUZZ1);
+  sbi(PORTB, BUZZ2);
 
-  for(int i = 0 ; i < 500 ; i++)
+  //Timer 0 keeps running for TELEMETRY, so start a whole flip from now
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-    cbi(PORTB, BUZZ1);
-    sbi(PORTB, BUZZ2);
-    delay_us(300);
-
-    sbi(PORTB, BUZZ1);
-    cbi(PORTB, BUZZ2);
-    delay_us(300);
+    OCR0A = TCNT0 + TONE_CLICKS;
+    TIFR0 = (1<<OCF0A); //Clear any old compare match
+    TIMSK0 |= (1<<OCIE0A);
   }
+}
+
+void tone_off(void)
+{
+  if(TIMSK0 & (1<<OCIE0A)) energy.buzzer_ms += wheel_time - tone_since;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) TIMSK0 &= ~(1<<OCIE0A);
 
   cbi(PORTB, BUZZ1);
   cbi(PORTB, BUZZ2);
 }
 
-void ioinit(void)
+//Drive the piezo from both sides, swapping every 300us. Budget 40 cycles.
+ISR (TIMER0_COMPA_vect)
 {
-  //1 = output, 0 = input
-  DDRB = 0b11111111 & ~((1<<BUT_UP)|(1<<BUT_DOWN)|(1<<BUT_ALARM)); //Up, Down, Alarm switch
-  DDRC = 0b11111111;
-  DDRD = 0b11111111 & ~(1<<BUT_SNOOZE); //Snooze button
+  trace_isr_start(TRACE_TONE);
 
-  PORTB = (1<<BUT_UP)|(1<<BUT_DOWN)|(1<<BUT_ALARM); //Enable pull-ups on these pins
-  PORTD = (1<<BUT_SNOOZE); //Enable pull-up on snooze button
-  PORTC = 0;
+  PINB = (1<<BUZZ1)|(1<<BUZZ2); //Writing a 1 to PINB toggles the pin
+  OCR0A += TONE_CLICKS;
 
-  //Init Timer0 for delay_us
-  TCCR0B = (1<<CS01); //Set Prescaler to clk/8 : 1click = 0.5us(assume we are running at external 16MHz). CS01=1
+  trace_isr_end(TRACE_TONE);
+}
 
-  //Init Timer1 for second counting
-  TCCR1B = (1<<CS12)|(1<<CS10); //Set prescaler to clk/1024 :1click = 64us (assume we are running at 16MHz)
-  TIMSK1 = (1<<TOIE1); //Enable overflow interrupts
-  TCNT1 = 49911; //65536 - 15,625 = 49,911 - Preload timer 1 for 49,911 clicks. Should be 1s per ISR call
+#ifdef TELEMETRY
 
-  //Init Timer2 for updating the display via interrupts
-  TCCR2B = (1<<CS22)|(1<<CS21)|(1<<CS20); //Set prescalar to clk/1024 : 1 click = 64us (assume 16MHz)
-  TIMSK2 = (1<<TOIE2); //TCNT2 should overflow every 16.384 ms (256 * 64us)
+//Send the next bit of the record, every TELEMETRY_BIT_CLICKS. Moving OCR0B on rather
+//than waiting keeps the bits evenly spaced however late the interrupt runs.
+ISR (TIMER0_COMPB_vect)
+{
+  trace_isr_start(TRACE_SERIAL);
 
+  OCR0B += TELEMETRY_BIT_CLICKS;
+
+  if(telemetry_bits & 1)
+    sbi(PORTB, TELEMETRY_PIN);
+  else
+    cbi(PORTB, TELEMETRY_PIN);
+  telemetry_bits >>= 1;
+
+  if(--telemetry_bits_left == 0)
+  {
+    if(telemetry_next == sizeof(telemetry))
+      TIMSK0 &= ~(1<<OCIE0B); //All sent, the line rests high after the stop bit
+    else
+    {
+      telemetry_bits = ((uint16_t)((uint8_t *)&telemetry)[telemetry_next++] << 1) | (1<<9);
+      telemetry_bits_left = 10;
+    }
+  }
+
+  trace_isr_end(TRACE_SERIAL);
 }
 
-//General short delays
-void delay_ms(uint16_t x)
+//Keep the longest time an interrupt has taken, from its trace_isr_start()
+static inline void isr_took(uint8_t source, uint8_t from)
 {
-  for (; x > 0 ; x--)
+  uint8_t took = TCNT2 - from;
+
+#if SLOT_US * (F_CPU / TIMER2_PRESCALER / 1000000) < 256
+  if(took >= SLOT_CLICKS) took += SLOT_CLICKS; //Timer 2 went round
+#endif
+  if(took > isr_max[source]) isr_max[source] = took;
+}
+
+//Fill in the next record and start sending it, run by TASK_TELEMETRY. A record is 16
+//bytes of 10 bits, each bit TELEMETRY_BIT_CLICKS of Timer 0 or 104us, so it takes 16.6ms.
+//The interrupt maxima are in Timer 2 clicks, 8 cycles each or 32 while a weak supply
+//has slowed Timer 2 down, see telemetry.state.
+void send_telemetry(void)
+{
+  uint8_t *byte = (uint8_t *)&telemetry;
+  uint8_t check = 0;
+  uint16_t frames;
+
+  if(TIMSK0 & (1<<OCIE0B)) return; //Still sending the last one
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) frames = frames_shown;
+
+  telemetry.sync = TELEMETRY_SYNC;
+  telemetry.hours = hours | ((ampm == PM) ? TELEMETRY_PM : 0);
+  telemetry.minutes = minutes;
+  telemetry.seconds = seconds;
+  telemetry.state = (supply_state << TELEMETRY_SUPPLY) |
+    (flags.alarm_on ? TELEMETRY_ALARM_ON : 0) |
+    (flags.snooze ? TELEMETRY_SNOOZE : 0) |
+    (hot.alarm_going ? TELEMETRY_ALARM_GOING : 0);
+  telemetry.refresh = frames - frames_sent;
+  frames_sent = frames;
+  telemetry.stack_free = stack_free;
+  for(uint8_t source = 0 ; source < TRACE_ISRS ; source++) telemetry.isr_max[source] = isr_max[source];
+
+  for(uint8_t i = 0 ; i < offsetof(struct telemetry, check) ; i++) check += byte[i];
+  telemetry.check = -check;
+
+  //The first byte is ready to go, the interrupt loads the rest
+  telemetry_bits = ((uint16_t)telemetry.sync << 1) | (1<<9);
+  telemetry_bits_left = 10;
+  telemetry_next = 1;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-    delay_us(250);
-    delay_us(250);
-    delay_us(250);
-    delay_us(250);
+    OCR0B = TCNT0 + TELEMETRY_BIT_CLICKS;
+    TIFR0 = (1<<OCF0B);
+    TIMSK0 |= (1<<OCIE0B);
   }
 }
 
-//General short delays
-void delay_us(uint16_t x)
+#else
+
+void send_telemetry(void) {}
+
+#endif
+
+void ioinit(void)
 {
-  x *= 2; //Correction for 16MHz
+  //1 = output, 0 = input
+  DDRB = 0b11111111 & ~((1<<BUT_UP)|(1<<BUT_DOWN)|(1<<BUT_ALARM)); //Up, Down, Alarm switch
+  DDRC = 0b11111111;
+  DDRD = 0b11111111 & ~(1<<BUT_SNOOZE); //Snooze button
 
-  while(x > 256)
-  {
-    TIFR0 = (1<<TOV0); //Clear any interrupt flags on Timer2
-    TCNT0 = 0; //256 - 125 = 131 : Preload timer 2 for x clicks. Should be 1us per click
-    while( (TIFR0 & (1<<TOV0)) == 0);
+  PORTB = (1<<BUT_UP)|(1<<BUT_DOWN)|(1<<BUT_ALARM); //Enable pull-ups on these pins
+  PORTD = (1<<BUT_SNOOZE); //Enable pull-up on snooze button
+  PORTC = 0;
 
-    x -= 256;
-  }
+  //Init Timer0 for the siren tone
+  TCCR0A = 0; //Normal mode, counting round freely. tone_on() sets OCR0A.
+  TCCR0B = (1<<CS01)|(1<<CS00); //Set Prescaler to clk/64 : 1click = 4us at 16MHz
 
-  TIFR0 = (1<<TOV0); //Clear any interrupt flags on Timer2
-  TCNT0 = 256 - x; //256 - 125 = 131 : Preload timer 2 for x clicks. Should be 1us per click
-  while( (TIFR0 & (1<<TOV0)) == 0);
+  //Init Timer1 for second counting
+  TCCR1B = (1<<WGM12)|TIMER1_CS; //CTC mode, set prescaler to TIMER1_PRESCALER
+  OCR1A = TIMER1_CLICKS_PER_SECOND - 1; //Clear after a second of clicks
+  TIMSK1 = (1<<OCIE1A); //Enable compare match interrupts
+
+  //Init Timer2 for the display slots
+  TCCR2A = (1<<WGM21); //CTC mode
+  TCCR2B = TIMER2_CS; //Set prescalar to clk/8 : 1 click = 0.5us at 16MHz
+  OCR2A = SLOT_CLICKS - 1; //128us per slot
+  OCR2B = BRIGHT * CLICKS_PER_US;
+  TIMSK2 = (1<<OCIE2A)|(1<<OCIE2B);
+
+  //The ADC reads the bandgap against VCC for check_supply()
+  ADMUX = (1<<REFS0)|(1<<MUX3)|(1<<MUX2)|(1<<MUX1); //AVCC reference, 1.1V bandgap input
+  ADCSRA = (1<<ADEN)|(1<<ADSC)|(1<<ADPS2)|(1<<ADPS1)|(1<<ADPS0); //Start, clk/128 : 125kHz at 16MHz
+
+  set_sleep_mode(SLEEP_MODE_IDLE); //Timers keep running while the main loop sleeps
 }
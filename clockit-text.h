@@ -0,0 +1,83 @@
+/*
+  ClockIt TEXT state shared with the tools in sim/
+
+  The tools look inside the running firmware, so the structures they read are defined
+  once here and included by clockit-text.c and by them. Change a layout here and
+  everything that reads it is rebuilt against the new one.
+*/
+
+#ifndef CLOCKIT_TEXT_H
+#define CLOCKIT_TEXT_H
+
+#include <stdint.h>
+
+//The main loop's own TRUE/FALSE flags, a bit each
+struct flags {
+  uint8_t snooze : 1; //The alarm goes off again at the snooze time
+  uint8_t alarm_on : 1; //The alarm switch, as check_alarm_switch() last saw it
+  uint8_t timer_running : 1;
+  uint8_t countdown_going : 1;
+  uint8_t wait_release : 1; //Ignore the buttons until they have all been let go
+  uint8_t display_blank : 1;
+  uint8_t light_sensing : 1; //A light reading is under way, see read_light()
+  uint8_t time_unsure : 1; //Restored after a brown-out, dot on digit 2 until the time is set
+};
+
+//Flags the interrupts and the main loop share, kept in GPIOR0 (HOT_FLAGS_IO, low enough for
+//sbi, cbi, sbis and sbic) where a bit can be set, cleared or tested in a single
+//instruction without using a register. Outside the interrupts only ever set them to
+//TRUE or FALSE, so they compile to sbi and cbi and can't undo a flag an interrupt has
+//just changed.
+struct hot_flags {
+  uint8_t flip : 1; //Toggled every second, for the colon
+  uint8_t flip_alarm : 1; //Set every second, for the alarm siren
+  uint8_t show_time_str : 1;
+  uint8_t alarm_going : 1;
+  uint8_t ticked : 1; //A second has gone, see clock_tick()
+  uint8_t new_minute : 1;
+  uint8_t new_day : 1;
+  uint8_t light_read : 1; //The LEDs have discharged, see read_light()
+};
+
+#define HOT_FLAGS_IO 0x1E //GPIOR0, the same on the atmega168 and atmega328p
+#define HOT_FLAGS_ADDRESS (HOT_FLAGS_IO + 0x20) //As a data address, for lds and sts and the simulator
+
+//What the clock has spent its power on since it was first programmed. The CPU was
+//running for on_ms - idle_ms. Saved to the EEPROM every hour and read back at power up.
+struct energy {
+  uint32_t lit_segment_ms; //Time each segment was lit, added up over all the segments
+  uint32_t buzzer_ms; //Time the piezo was driven
+  uint32_t idle_ms; //Time the CPU was asleep
+  uint32_t on_ms; //Time the clock was powered
+};
+
+extern struct flags flags;
+extern struct energy energy;
+
+//Build with TRACE set to a mask of what to trace (make TRACE=0x201, see the Makefile) to keep
+//the last TRACE_SIZE events in trace[], each with the Timer 1 count it happened at. Bits 0-5
+//are the interrupts below and bit 8 + task a scheduled task. PB3 is high while a traced
+//interrupt runs, for a logic analyser or the VCD from make probe. Without TRACE none of it
+//is built in.
+#define TRACE_SECOND 0 //Timer 1, the second tick
+#define TRACE_SLOT   1 //Timer 2 compare A, a display slot lights
+#define TRACE_DARK   2 //Timer 2 compare B, the slot goes dark
+#define TRACE_TONE   3 //Timer 0, the buzzer tone
+#define TRACE_LIGHT  4 //Pin change, the LEDs have discharged
+#define TRACE_SERIAL 5 //Timer 0 compare B, a TELEMETRY bit
+#define TRACE_ISRS   6
+#define TRACE_TASK   8 //Plus the task number, a task run by run_tasks()
+#define TRACE_END    0x80 //Added to the event for the end of a handler or task
+#define TRACE_SIZE   64 //Events kept, must be a power of 2
+
+#ifdef TRACE
+struct trace_record {
+  uint8_t event; //TRACE_ event, with TRACE_END added at the end
+  uint16_t when; //TCNT1, clicks into the second
+};
+
+extern struct trace_record trace[TRACE_SIZE]; //Oldest first from trace_next
+extern uint8_t trace_next; //Where the next event goes, over the oldest
+#endif
+
+#endif
@@ -0,0 +1,344 @@
+/*
+  ClockIt benchmark
+
+  Runs clockit-text.elf in simavr with the display at BRIGHT (a lit room) and at DIM (the dark)
+  and reports, for each:
+  - the cycles spent in each interrupt handler (count, min, avg, max)
+  - how often each digit is lit, how long for and the fraction of time it is lit
+  - main loop iterations per second and the fraction of time the CPU is asleep
+  - the firmware's own energy counters over the same time: segments lit on average,
+    and the share of the time the buzzer sounded and the CPU slept
+
+  The results are written as JSON, one value per line, so a change in them shows up
+  clearly when the file is diffed.
+
+  Interrupt budgets can follow as NAME=cycles, e.g. TIMER2_COMPA=80. The run fails if a
+  handler ever takes longer than its budget. Either way the budgets the measurements
+  support, the most cycles each handler took plus BUDGET_MARGIN percent, are printed
+  to stderr last as an ISR_BUDGETS line the makefile can include, see make bench-budgets.
+
+  usage: bench mcu f_cpu clockit-text.elf clockit-text.sym seconds [NAME=cycles...] > bench.json
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sim_avr.h>
+#include <sim_io.h>
+#include <avr_ioport.h>
+
+#include "sim.h"
+#include "../clockit-text.h"
+
+#define AM  1
+#define PM  2
+
+#define VECTORS 26
+#define MAX_NESTING 4
+#define WARM_UP 4.1 //Seconds, so a light reading is taken before measuring
+#define BRIGHT_ROOM_US 1000 //LED discharge times, a lit room gives BRIGHT
+#define DARK_ROOM_US 0 //Never discharges, DIM
+#define BUDGET_MARGIN 25 //Percent over the most cycles measured when suggesting a budget
+
+//struct energy, read from the simulated RAM a 32 bit counter at a time
+#define ENERGY_COUNTERS (sizeof(struct energy) / sizeof(uint32_t))
+enum { LIT_SEGMENT_MS, BUZZER_MS, IDLE_MS, ON_MS };
+
+//Same vector table for the atmega88, atmega168 and atmega328p
+static const char *vector_names[VECTORS] = {
+  "RESET", "INT0", "INT1", "PCINT0", "PCINT1", "PCINT2", "WDT",
+  "TIMER2_COMPA", "TIMER2_COMPB", "TIMER2_OVF", "TIMER1_CAPT", "TIMER1_COMPA",
+  "TIMER1_COMPB", "TIMER1_OVF", "TIMER0_COMPA", "TIMER0_COMPB", "TIMER0_OVF",
+  "SPI_STC", "USART_RX", "USART_UDRE", "USART_TX", "ADC", "EE_READY",
+  "ANALOG_COMP", "TWI", "SPM_READY",
+};
+
+//Digit select pins on PORTD (low to light) for digits 1-4 and the colon/AM dot
+#define DIGITS 5
+static const int digit_pins[DIGITS] = { 0, 1, 4, 6, 3 };
+static const char *digit_names[DIGITS] = { "1", "2", "3", "4", "colon" };
+
+#define PORTD_SEGMENTS ((1<<2)|(1<<5)) //Segment D and the decimal point
+
+struct isr_stats {
+  uint32_t count;
+  uint64_t total;
+  uint32_t min;
+  uint32_t max;
+};
+
+static uint32_t budgets[VECTORS]; //Most cycles each handler may take, 0 for no limit
+static int over_budget;
+static uint32_t worst[VECTORS]; //Most cycles each handler took in any scenario
+
+struct bench {
+  avr_t *avr;
+
+  //Interrupt handlers being run, innermost last
+  struct {
+    int vector;
+    uint16_t sp;
+    avr_cycle_count_t start;
+  } active[MAX_NESTING];
+  int depth;
+  struct isr_stats isr[VECTORS];
+
+  //Display
+  uint8_t portc, portd;
+  int lit; //Bit for each lit digit
+  avr_cycle_count_t last_change;
+  avr_cycle_count_t lit_cycles[DIGITS];
+  uint32_t lit_count[DIGITS];
+
+  //Main loop, which sleeps once per iteration
+  int sleeping;
+  uint32_t sleeps;
+  avr_cycle_count_t sleep_cycles;
+  avr_cycle_count_t step_cycle;
+
+  //The firmware's struct energy when measuring started
+  uint32_t energy[ENERGY_COUNTERS];
+};
+
+static void read_energy(avr_t *avr, uint32_t *counters)
+{
+  uint8_t *energy = sim_data(avr, "energy");
+
+  for(int i = 0 ; i < ENERGY_COUNTERS ; i++, energy += 4)
+    counters[i] = energy[0] | energy[1] << 8 | energy[2] << 16 | (uint32_t)energy[3] << 24;
+}
+
+static void clear_stats(struct bench *bench)
+{
+  memset(bench->isr, 0, sizeof(bench->isr));
+  memset(bench->lit_cycles, 0, sizeof(bench->lit_cycles));
+  memset(bench->lit_count, 0, sizeof(bench->lit_count));
+  bench->sleeps = 0;
+  bench->sleep_cycles = 0;
+  bench->last_change = bench->avr->cycle;
+  read_energy(bench->avr, bench->energy);
+}
+
+static void step(avr_t *avr, void *param)
+{
+  struct bench *bench = param;
+  uint16_t sp = avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+
+  if(bench->sleeping) bench->sleep_cycles += avr->cycle - bench->step_cycle;
+  if(avr->state == cpu_Sleeping && !bench->sleeping) bench->sleeps++;
+  bench->sleeping = (avr->state == cpu_Sleeping);
+  bench->step_cycle = avr->cycle;
+
+  //reti has popped the return address pushed when the handler was entered
+  while(bench->depth > 0 && sp > bench->active[bench->depth - 1].sp)
+  {
+    bench->depth--;
+
+    struct isr_stats *stats = &bench->isr[bench->active[bench->depth].vector];
+    uint32_t cycles = avr->cycle - bench->active[bench->depth].start;
+
+    if(stats->count == 0 || cycles < stats->min) stats->min = cycles;
+    if(cycles > stats->max) stats->max = cycles;
+    stats->total += cycles;
+    stats->count++;
+  }
+
+  //simavr leaves the pc on the vector when it takes an interrupt
+  if(avr->pc != 0 && avr->pc < VECTORS * avr->vector_size && avr->pc % avr->vector_size == 0 &&
+     bench->depth < MAX_NESTING)
+  {
+    bench->active[bench->depth].vector = avr->pc / avr->vector_size;
+    bench->active[bench->depth].sp = sp;
+    bench->active[bench->depth].start = avr->cycle;
+    bench->depth++;
+  }
+}
+
+static void port_changed(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+  struct bench *bench = param;
+  avr_cycle_count_t now = bench->avr->cycle;
+  int lit = 0;
+
+  for(int digit = 0 ; digit < DIGITS ; digit++)
+  {
+    if(bench->lit & (1 << digit)) bench->lit_cycles[digit] += now - bench->last_change;
+  }
+  bench->last_change = now;
+
+  if(irq == avr_io_getirq(bench->avr, AVR_IOCTL_IOPORT_GETIRQ('C'), IOPORT_IRQ_PIN_ALL))
+    bench->portc = value;
+  else
+    bench->portd = value;
+
+  if((bench->portc & 0x3F) || (bench->portd & PORTD_SEGMENTS))
+  {
+    for(int digit = 0 ; digit < DIGITS ; digit++)
+    {
+      if((bench->portd & (1 << digit_pins[digit])) == 0) lit |= 1 << digit;
+    }
+  }
+
+  for(int digit = 0 ; digit < DIGITS ; digit++)
+  {
+    if((lit & (1 << digit)) && !(bench->lit & (1 << digit))) bench->lit_count[digit]++;
+  }
+  bench->lit = lit;
+}
+
+static void report(struct bench *bench, const char *name, double seconds, int last)
+{
+  double cycles = seconds * bench->avr->frequency;
+  int first = 1;
+
+  printf("    \"%s\": {\n", name);
+
+  printf("      \"isr\": {\n");
+  for(int vector = 1 ; vector < VECTORS ; vector++)
+  {
+    struct isr_stats *stats = &bench->isr[vector];
+
+    if(stats->count == 0) continue;
+
+    printf("%s        \"%s_vect\": {\n", first ? "" : ",\n", vector_names[vector]);
+    printf("          \"count\": %u,\n", stats->count);
+    printf("          \"min_cycles\": %u,\n", stats->min);
+    printf("          \"avg_cycles\": %.1f,\n", (double)stats->total / stats->count);
+    printf("          \"max_cycles\": %u,\n", stats->max);
+    if(budgets[vector] != 0) printf("          \"budget_cycles\": %u,\n", budgets[vector]);
+    printf("          \"cpu\": %.4f\n", stats->total / cycles);
+    printf("        }");
+    first = 0;
+
+    if(stats->max > worst[vector]) worst[vector] = stats->max;
+
+    if(budgets[vector] != 0 && stats->max > budgets[vector])
+    {
+      fprintf(stderr, "%s: %s_vect took %u cycles, its budget is %u\n", name, vector_names[vector],
+              stats->max, budgets[vector]);
+      over_budget++;
+    }
+  }
+  printf("\n      },\n");
+
+  printf("      \"digits\": {\n");
+  for(int digit = 0 ; digit < DIGITS ; digit++)
+  {
+    uint32_t count = bench->lit_count[digit];
+
+    printf("        \"%s\": {\n", digit_names[digit]);
+    printf("          \"refresh_hz\": %.1f,\n", count / seconds);
+    printf("          \"on_us\": %.2f,\n", count ? bench->lit_cycles[digit] * 1e6 / bench->avr->frequency / count : 0.0);
+    printf("          \"duty\": %.5f\n", bench->lit_cycles[digit] / cycles);
+    printf("        }%s\n", digit == DIGITS - 1 ? "" : ",");
+  }
+  printf("      },\n");
+
+  printf("      \"main_loop_per_second\": %.1f,\n", bench->sleeps / seconds);
+  printf("      \"cpu_asleep\": %.4f,\n", bench->sleep_cycles / cycles);
+
+  //The firmware adds up its counters once a second, so compare them with its own on time
+  uint32_t energy[ENERGY_COUNTERS];
+  read_energy(bench->avr, energy);
+  double on_ms = energy[ON_MS] - bench->energy[ON_MS];
+
+  printf("      \"energy\": {\n");
+  printf("        \"segments_lit\": %.4f,\n", on_ms ? (energy[LIT_SEGMENT_MS] - bench->energy[LIT_SEGMENT_MS]) / on_ms : 0.0);
+  printf("        \"buzzer\": %.4f,\n", on_ms ? (energy[BUZZER_MS] - bench->energy[BUZZER_MS]) / on_ms : 0.0);
+  printf("        \"idle\": %.4f\n", on_ms ? (energy[IDLE_MS] - bench->energy[IDLE_MS]) / on_ms : 0.0);
+  printf("      }\n");
+  printf("    }%s\n", last ? "" : ",");
+}
+
+static void read_budget(const char *arg)
+{
+  char name[32];
+  unsigned cycles;
+
+  if(sscanf(arg, "%31[^=]=%u", name, &cycles) == 2)
+  {
+    for(int vector = 0 ; vector < VECTORS ; vector++)
+    {
+      if(strcmp(vector_names[vector], name) == 0)
+      {
+        budgets[vector] = cycles;
+        return;
+      }
+    }
+  }
+
+  fprintf(stderr, "Bad interrupt budget %s\n", arg);
+  exit(1);
+}
+
+static void scenario(struct bench *bench, const char *name, uint8_t hours, uint8_t ampm, uint32_t light_us, double seconds, int last)
+{
+  avr_t *avr = bench->avr;
+
+  //The next light reading picks the brightness, or the second tick from the time
+  //without LIGHT_SENSOR. A light_level of 0 takes the reading as it is, unfiltered.
+  *sim_data(avr, "hours") = hours;
+  *sim_data(avr, "minutes") = 0;
+  *sim_data(avr, "ampm") = ampm;
+  sim_set_light(avr, light_us);
+  memset(sim_data(avr, "light_level"), 0, 2);
+
+  sim_run(avr, WARM_UP * avr->frequency, step, bench);
+
+  clear_stats(bench);
+  sim_run(avr, seconds * avr->frequency, step, bench);
+  report(bench, name, seconds, last);
+}
+
+int main(int argc, char *argv[])
+{
+  struct bench bench;
+  double seconds;
+  uint8_t *stack_free;
+
+  if(argc < 6)
+  {
+    fprintf(stderr, "usage: %s mcu f_cpu clockit-text.elf clockit-text.sym seconds [NAME=cycles...]\n", argv[0]);
+    return(1);
+  }
+
+  for(int arg = 6 ; arg < argc ; arg++) read_budget(argv[arg]);
+
+  memset(&bench, 0, sizeof(bench));
+  seconds = atof(argv[5]);
+
+  bench.avr = sim_load(argv[3], argv[1], strtoul(argv[2], NULL, 10));
+  sim_read_symbols(argv[4]);
+  sim_release_buttons(bench.avr, 1);
+
+  avr_irq_register_notify(avr_io_getirq(bench.avr, AVR_IOCTL_IOPORT_GETIRQ('C'), IOPORT_IRQ_PIN_ALL), port_changed, &bench);
+  avr_irq_register_notify(avr_io_getirq(bench.avr, AVR_IOCTL_IOPORT_GETIRQ('D'), IOPORT_IRQ_PIN_ALL), port_changed, &bench);
+
+  //Let the power up siren finish
+  sim_run(bench.avr, 1 * bench.avr->frequency, step, &bench);
+
+  printf("{\n");
+  printf("  \"mcu\": \"%s\",\n", argv[1]);
+  printf("  \"f_cpu\": %s,\n", argv[2]);
+  printf("  \"seconds\": %g,\n", seconds);
+  printf("  \"scenarios\": {\n");
+  scenario(&bench, "bright", 12, PM, BRIGHT_ROOM_US, seconds, 0);
+  scenario(&bench, "dim", 11, PM, DARK_ROOM_US, seconds, 1);
+  printf("  },\n");
+  stack_free = sim_data(bench.avr, "stack_free"); //Least stack headroom the firmware has seen
+  printf("  \"stack_free\": %u\n", stack_free[0] | stack_free[1] << 8);
+  printf("}\n");
+
+  fprintf(stderr, "# Measured by sim/bench for %s at %s Hz, the most cycles each handler took + %d%%\n",
+          argv[1], argv[2], BUDGET_MARGIN);
+  fprintf(stderr, "ISR_BUDGETS =");
+  for(int vector = 1 ; vector < VECTORS ; vector++)
+  {
+    if(worst[vector] != 0)
+      fprintf(stderr, " %s=%u", vector_names[vector], (worst[vector] * (100 + BUDGET_MARGIN) + 99) / 100);
+  }
+  fprintf(stderr, "\n");
+
+  return(over_budget != 0);
+}
@@ -0,0 +1,23 @@
+/*
+  Host stand-in for <avr/eeprom.h>. EEMEM variables are ordinary variables on the host,
+  so reading or writing one goes straight to the variable.
+*/
+
+#ifndef HOST_AVR_EEPROM_H
+#define HOST_AVR_EEPROM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define EEMEM
+
+#define eeprom_is_ready() 1 //Host writes finish straight away
+
+static inline uint8_t eeprom_read_byte(const uint8_t *address) { return *address; }
+static inline uint16_t eeprom_read_word(const uint16_t *address) { return *address; }
+static inline void eeprom_write_byte(uint8_t *address, uint8_t value) { *address = value; }
+static inline void eeprom_write_word(uint16_t *address, uint16_t value) { *address = value; }
+static inline void eeprom_read_block(void *to, const void *from, size_t size) { memcpy(to, from, size); }
+static inline void eeprom_update_block(const void *from, void *to, size_t size) { memcpy(to, from, size); }
+
+#endif
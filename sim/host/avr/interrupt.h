@@ -0,0 +1,15 @@
+/*
+  Host stand-in for <avr/interrupt.h>. Handlers become plain functions named after
+  their vector, which sim/replay.c calls when the simulated timers say so.
+*/
+
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+
+#define ISR(vector, ...) void vector(void); void vector(void)
+
+//Handlers are only ever called between main loop steps, so nothing needs masking
+#define sei()
+#define cli()
+
+#endif
@@ -0,0 +1,155 @@
+/*
+  Host stand-in for <avr/io.h>, for building clockit-text.c into sim/replay.
+
+  The registers are plain variables. sim/replay.c defines them by setting
+  HOST_REGISTER before including this, everything else sees them as extern.
+*/
+
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+#include <stdint.h>
+
+#ifndef HOST_REGISTER
+#define HOST_REGISTER(type, name) extern volatile type name;
+#endif
+
+HOST_REGISTER(uint8_t, PINB)
+HOST_REGISTER(uint8_t, DDRB)
+HOST_REGISTER(uint8_t, PORTB)
+HOST_REGISTER(uint8_t, PINC)
+HOST_REGISTER(uint8_t, DDRC)
+HOST_REGISTER(uint8_t, PORTC)
+HOST_REGISTER(uint8_t, PIND)
+HOST_REGISTER(uint8_t, DDRD)
+HOST_REGISTER(uint8_t, PORTD)
+
+HOST_REGISTER(uint8_t, TCCR0A)
+HOST_REGISTER(uint8_t, TCCR0B)
+HOST_REGISTER(uint8_t, TCNT0)
+HOST_REGISTER(uint8_t, OCR0A)
+HOST_REGISTER(uint8_t, OCR0B)
+HOST_REGISTER(uint8_t, TIMSK0)
+HOST_REGISTER(uint8_t, TIFR0)
+
+HOST_REGISTER(uint8_t, TCCR1A)
+HOST_REGISTER(uint8_t, TCCR1B)
+HOST_REGISTER(uint16_t, TCNT1)
+HOST_REGISTER(uint16_t, OCR1A)
+HOST_REGISTER(uint16_t, OCR1B)
+HOST_REGISTER(uint8_t, TIMSK1)
+HOST_REGISTER(uint8_t, TIFR1)
+
+HOST_REGISTER(uint8_t, TCCR2A)
+HOST_REGISTER(uint8_t, TCCR2B)
+HOST_REGISTER(uint8_t, TCNT2)
+HOST_REGISTER(uint8_t, OCR2A)
+HOST_REGISTER(uint8_t, OCR2B)
+HOST_REGISTER(uint8_t, TIMSK2)
+HOST_REGISTER(uint8_t, TIFR2)
+
+HOST_REGISTER(uint8_t, ADMUX)
+HOST_REGISTER(uint8_t, ADCSRA)
+HOST_REGISTER(uint16_t, ADC)
+
+HOST_REGISTER(uint8_t, SREG)
+HOST_REGISTER(uint8_t, GPIOR0)
+HOST_REGISTER(uint8_t, GPIOR1)
+HOST_REGISTER(uint8_t, GPIOR2)
+HOST_REGISTER(uint8_t, MCUSR)
+HOST_REGISTER(uint8_t, WDTCSR)
+HOST_REGISTER(uint8_t, PCICR)
+HOST_REGISTER(uint8_t, PCIFR)
+HOST_REGISTER(uint8_t, PCMSK2)
+
+#define PINB0   0
+#define PINB1   1
+#define PINB2   2
+#define PINB3   3
+#define PINB4   4
+#define PINB5   5
+#define PORTB0  0
+#define PORTB1  1
+#define PORTB2  2
+#define PORTB3  3
+#define PORTB4  4
+#define PORTB5  5
+
+#define PORTC0  0
+#define PORTC1  1
+#define PORTC2  2
+#define PORTC3  3
+#define PORTC4  4
+#define PORTC5  5
+
+#define PIND0   0
+#define PIND7   7
+#define PORTD0  0
+#define PORTD1  1
+#define PORTD2  2
+#define PORTD3  3
+#define PORTD4  4
+#define PORTD5  5
+#define PORTD6  6
+#define PORTD7  7
+
+#define PCIE2   2
+#define PCIF2   2
+#define PCINT22 6
+
+#define WGM00   0
+#define WGM01   1
+#define CS00    0
+#define CS01    1
+#define CS02    2
+#define OCIE0A  1
+#define OCIE0B  2
+#define OCF0A   1
+#define OCF0B   2
+
+#define WGM12   3
+#define WGM13   4
+#define CS10    0
+#define CS11    1
+#define CS12    2
+#define OCIE1A  1
+#define OCF1A   1
+
+#define WGM20   0
+#define WGM21   1
+#define CS20    0
+#define CS21    1
+#define CS22    2
+#define OCIE2A  1
+#define OCIE2B  2
+#define OCF2A   1
+#define OCF2B   2
+
+#define MUX0    0
+#define MUX1    1
+#define MUX2    2
+#define MUX3    3
+#define REFS0   6
+#define ADPS0   0
+#define ADPS1   1
+#define ADPS2   2
+#define ADSC    6
+#define ADEN    7
+
+#define PORF    0
+#define EXTRF   1
+#define BORF    2
+#define WDRF    3
+
+#define WDP0    0
+#define WDP1    1
+#define WDP2    2
+#define WDE     3
+#define WDCE    4
+#define WDP3    5
+#define WDIE    6
+#define WDIF    7
+
+#define _BV(bit) (1 << (bit))
+
+#endif
@@ -0,0 +1,23 @@
+/*
+  Host stand-in for <avr/pgmspace.h>. Program memory is ordinary memory on the host.
+*/
+
+#ifndef HOST_AVR_PGMSPACE_H
+#define HOST_AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+//Tables of pointers hold host sized pointers, so read whatever size the entry is
+#define pgm_read_word(address) ({ uintptr_t host_word = 0; \
+  memcpy(&host_word, (address), sizeof(*(address))); host_word; })
+
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define strcpy_P strcpy
+
+#endif
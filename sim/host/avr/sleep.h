@@ -0,0 +1,16 @@
+/*
+  Host stand-in for <avr/sleep.h>. The main loop sleeps until the next interrupt, on
+  the host that is where sim/replay.c moves time on and runs the script.
+*/
+
+#ifndef HOST_AVR_SLEEP_H
+#define HOST_AVR_SLEEP_H
+
+#define SLEEP_MODE_IDLE 0
+
+void host_sleep(void);
+
+#define set_sleep_mode(mode)
+#define sleep_mode() host_sleep()
+
+#endif
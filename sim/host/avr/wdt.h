@@ -0,0 +1,15 @@
+/*
+  Host stand-in for <avr/wdt.h>. Nothing on the host resets, so the watchdog does nothing.
+*/
+
+#ifndef HOST_AVR_WDT_H
+#define HOST_AVR_WDT_H
+
+#define WDTO_15MS   0
+#define WDTO_250MS  4
+
+#define wdt_reset()
+#define wdt_enable(timeout)
+#define wdt_disable()
+
+#endif
@@ -0,0 +1,12 @@
+/*
+  Host stand-in for <util/atomic.h>. Interrupts never break into the firmware on the
+  host, so the block just runs once.
+*/
+
+#ifndef HOST_UTIL_ATOMIC_H
+#define HOST_UTIL_ATOMIC_H
+
+#define ATOMIC_BLOCK(type) for(int host_atomic_once = 1 ; host_atomic_once ; host_atomic_once = 0)
+#define ATOMIC_RESTORESTATE
+
+#endif
@@ -0,0 +1,331 @@
+/*
+  ClockIt microbenchmarks
+
+  Calls the hot routines of clockit-text.elf in simavr over their whole input range
+  and reports the cycles each call took (calls, min, avg, max):
+  - display_number for every number and digit
+  - display_character for every character code and position
+  - update_time_str for all 720 times, AM and PM
+  - append_str_P for every string in num_table and tens_table
+  - check_alarm for every alarm time, with and without snooze, switch on and off
+  - ramp_time for every time and alarm, UP and DOWN, just pressed and held down
+
+  Given a baseline written by an earlier run, each routine is compared against it and
+  the run fails if the average or the worst case has grown by more than tolerance percent.
+  It also fails if the baseline can't be read, or if it has no line for one of the routines.
+  make microbench-baseline starts the baseline with a #made with line naming the compiler,
+  which is repeated when the run fails, as a new compiler moves the counts as well.
+
+  usage: microbench mcu f_cpu clockit-text.elf clockit-text.sym [baseline [tolerance]]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sim_avr.h>
+
+#include "sim.h"
+#include "../clockit-text.h" //struct flags and struct hot_flags, as the firmware lays them out
+
+#define AM  1
+#define PM  2
+
+//One bit of struct flags or struct hot_flags as a mask. avr-gcc and the host compiler
+//both fill a byte of bit fields from bit 0 up.
+#define FLAG_MASK(type, field) (((union { struct type bits; uint8_t byte; }){ .bits = { .field = 1 } }).byte)
+
+#define BOOT_TIME 0.02 //Seconds to run before the first call, so .data and .bss are set up
+#define UPTIME 10 //Seconds millis() is held at while ramping, so a press can be backdated
+#define MAX_ROUTINES 16
+
+struct cost {
+  const char *name;
+  uint32_t calls;
+  uint64_t total;
+  uint32_t min;
+  uint32_t max;
+};
+
+static struct cost costs[MAX_ROUTINES];
+static int cost_count;
+
+static avr_t *avr;
+
+static struct cost *new_cost(const char *name)
+{
+  struct cost *cost = &costs[cost_count++];
+
+  cost->name = name;
+  cost->min = UINT32_MAX;
+  return(cost);
+}
+
+static void call(struct cost *cost, uint32_t function, uint16_t arg0, uint16_t arg1, uint16_t arg2)
+{
+  uint32_t cycles = sim_call(avr, function, arg0, arg1, arg2);
+
+  cost->calls++;
+  cost->total += cycles;
+  if(cycles < cost->min) cost->min = cycles;
+  if(cycles > cost->max) cost->max = cycles;
+}
+
+static void set_time(const char *prefix, uint8_t hours, uint8_t minutes, uint8_t ampm)
+{
+  char name[32];
+
+  snprintf(name, sizeof(name), "hours%s", prefix);
+  *sim_data(avr, name) = hours;
+  snprintf(name, sizeof(name), "minutes%s", prefix);
+  *sim_data(avr, name) = minutes;
+  if(prefix[0] == 0) *sim_data(avr, "seconds") = 0; //The alarms have no seconds
+  snprintf(name, sizeof(name), "ampm%s", prefix);
+  *sim_data(avr, name) = ampm;
+}
+
+static void set_long(const char *name, uint32_t value)
+{
+  uint8_t *data = sim_data(avr, name);
+
+  for(int byte = 0 ; byte < 4 ; byte++) data[byte] = value >> (8 * byte);
+}
+
+static void set_flag(uint8_t flag, int on)
+{
+  uint8_t *flags = sim_data(avr, "flags");
+
+  if(on)
+    *flags |= flag;
+  else
+    *flags &= ~flag;
+}
+
+static void bench_display(void)
+{
+  struct cost *number = new_cost("display_number");
+  struct cost *character = new_cost("display_character");
+  uint32_t display_number = sim_symbol("display_number");
+  uint32_t display_character = sim_symbol("display_character");
+  uint8_t *frame_pos = sim_data(avr, "frame_pos");
+
+  //Numbers past 12 show nothing, one is enough for that path
+  for(int value = 0 ; value <= 13 ; value++)
+  {
+    for(int digit = 1 ; digit <= 5 ; digit++)
+    {
+      *frame_pos = 0; //A full frame ignores further slots
+      call(number, display_number, value, digit, 0);
+    }
+  }
+
+  for(int value = 0 ; value < 128 ; value++)
+  {
+    for(int position = 1 ; position <= 4 ; position++)
+    {
+      *frame_pos = 0;
+      call(character, display_character, value, position, 0);
+    }
+  }
+}
+
+static void bench_strings(void)
+{
+  struct cost *update = new_cost("update_time_str");
+  struct cost *append = new_cost("append_str_P");
+  uint32_t update_time_str = sim_symbol("update_time_str");
+  uint32_t append_str_P = sim_symbol("append_str_P");
+  uint16_t time_str = sim_symbol("time_str") & 0xFFFF;
+  uint32_t num_table = sim_symbol("num_table");
+  uint32_t tens_table = sim_symbol("tens_table");
+
+  for(int ampm = AM ; ampm <= PM ; ampm++)
+  {
+    for(int hours = 1 ; hours <= 12 ; hours++)
+    {
+      for(int minutes = 0 ; minutes < 60 ; minutes++)
+      {
+        set_time("", hours, minutes, ampm);
+        call(update, update_time_str, 0, 0, 0);
+      }
+    }
+  }
+
+  for(int entry = 0 ; entry < 20 ; entry++)
+    call(append, append_str_P, time_str, sim_flash_word(avr, num_table + 2 * entry), 0);
+  for(int entry = 0 ; entry < 6 ; entry++)
+    call(append, append_str_P, time_str, sim_flash_word(avr, tens_table + 2 * entry), 0);
+}
+
+static void bench_alarm(void)
+{
+  struct cost *alarm = new_cost("check_alarm");
+  uint32_t check_alarm = sim_symbol("check_alarm");
+
+  set_time("", 10, 0, AM);
+
+  for(int alarm_on = 0 ; alarm_on <= 1 ; alarm_on++)
+  {
+    sim_release_buttons(avr, alarm_on);
+    set_flag(FLAG_MASK(flags, alarm_on), alarm_on); //As if check_alarm_switch() had already seen it
+
+    for(int snooze = 0 ; snooze <= 1 ; snooze++)
+    {
+      for(int ampm = AM ; ampm <= PM ; ampm++)
+      {
+        for(int hours = 1 ; hours <= 12 ; hours++)
+        {
+          for(int minutes = 0 ; minutes < 60 ; minutes++)
+          {
+            set_time("_alarm", hours, minutes, ampm);
+            set_time("_alarm_snooze", hours, minutes, ampm);
+            set_flag(FLAG_MASK(flags, snooze), snooze);
+            avr->data[HOT_FLAGS_ADDRESS] &= ~FLAG_MASK(hot_flags, alarm_going);
+            call(alarm, check_alarm, 0, 0, 0);
+          }
+        }
+      }
+    }
+  }
+
+  sim_release_buttons(avr, 1);
+}
+
+static void bench_ramp(void)
+{
+  struct cost *ramp = new_cost("ramp_time");
+  uint32_t ramp_time = sim_symbol("ramp_time");
+  const char *prefixes[] = { "", "_alarm" };
+
+  //millis() only counts the ms into the second on top of UPTIME, so the press can be
+  //put just now or long enough ago for the biggest steps
+  set_long("uptime_seconds", UPTIME);
+
+  for(int setting = 0 ; setting <= 1 ; setting++)
+  {
+    char name[32];
+    uint16_t hours, minutes, ampm;
+
+    snprintf(name, sizeof(name), "hours%s", prefixes[setting]);
+    hours = sim_symbol(name) & 0xFFFF;
+    snprintf(name, sizeof(name), "minutes%s", prefixes[setting]);
+    minutes = sim_symbol(name) & 0xFFFF;
+    snprintf(name, sizeof(name), "ampm%s", prefixes[setting]);
+    ampm = sim_symbol(name) & 0xFFFF;
+
+    for(int button = 0 ; button <= 1 ; button++)
+    {
+      if(button == 0)
+        sim_set_pin(avr, SIM_BUT_UP, 0);
+      else
+        sim_set_pin(avr, SIM_BUT_DOWN, 0);
+
+      for(int held = 0 ; held <= 1 ; held++)
+      {
+        for(int am_pm = AM ; am_pm <= PM ; am_pm++)
+        {
+          for(int hour = 1 ; hour <= 12 ; hour++)
+          {
+            for(int minute = 0 ; minute < 60 ; minute++)
+            {
+              set_time(prefixes[setting], hour, minute, am_pm);
+              set_long("buttons_since", held ? 0 : UPTIME * 1000);
+              call(ramp, ramp_time, hours, minutes, ampm);
+            }
+          }
+        }
+      }
+
+      sim_release_buttons(avr, 1);
+    }
+  }
+}
+
+//Compare with the baseline, returns the number of routines that got slower or aren't in it
+static int compare(const char *baseline_file, double tolerance)
+{
+  FILE *file = fopen(baseline_file, "r");
+  char line[128];
+  char made_with[128] = "";
+  int slower = 0;
+  int found[MAX_ROUTINES] = { 0 };
+
+  if(file == NULL)
+  {
+    fprintf(stderr, "No baseline in %s, run make microbench-baseline and commit it\n", baseline_file);
+    return(cost_count);
+  }
+
+  fprintf(stderr, "%-20s %10s %10s %10s %10s\n", "routine", "avg", "was", "max", "was");
+  while(fgets(line, sizeof(line), file) != NULL)
+  {
+    char name[64];
+    unsigned calls, min, max;
+    double avg;
+
+    if(strncmp(line, "#made with ", 11) == 0) strcpy(made_with, line + 11);
+    if(line[0] == '#' || sscanf(line, "%63s %u %u %lf %u", name, &calls, &min, &avg, &max) != 5) continue;
+
+    for(int i = 0 ; i < cost_count ; i++)
+    {
+      struct cost *cost = &costs[i];
+      double now_avg = (double)cost->total / cost->calls;
+
+      if(strcmp(cost->name, name) != 0) continue;
+      found[i] = 1;
+
+      int worse = now_avg > avg * (1 + tolerance / 100) || cost->max > max * (1 + tolerance / 100);
+      fprintf(stderr, "%-20s %10.1f %10.1f %10u %10u%s\n", name, now_avg, avg, cost->max, max,
+              worse ? "  SLOWER" : "");
+      slower += worse;
+    }
+  }
+
+  fclose(file);
+
+  for(int i = 0 ; i < cost_count ; i++)
+  {
+    if(found[i]) continue;
+    fprintf(stderr, "%-20s not in %s\n", costs[i].name, baseline_file);
+    slower++;
+  }
+
+  if(slower != 0 && made_with[0] != 0) fprintf(stderr, "%s was made with %s", baseline_file, made_with);
+  return(slower);
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc < 5 || argc > 7)
+  {
+    fprintf(stderr, "usage: %s mcu f_cpu clockit-text.elf clockit-text.sym [baseline [tolerance]]\n", argv[0]);
+    return(1);
+  }
+
+  avr = sim_load(argv[3], argv[1], strtoul(argv[2], NULL, 10));
+  sim_read_symbols(argv[4]);
+  sim_release_buttons(avr, 1);
+
+  sim_run(avr, BOOT_TIME * avr->frequency, NULL, NULL);
+
+  bench_display();
+  bench_strings();
+  bench_alarm();
+  bench_ramp();
+
+  printf("#%-19s %8s %8s %10s %8s\n", "routine", "calls", "min", "avg", "max");
+  for(int i = 0 ; i < cost_count ; i++)
+  {
+    struct cost *cost = &costs[i];
+    printf("%-20s %8u %8u %10.1f %8u\n", cost->name, cost->calls, cost->min,
+           (double)cost->total / cost->calls, cost->max);
+  }
+
+  if(argc >= 6 && compare(argv[5], argc == 7 ? atof(argv[6]) : 0) != 0)
+  {
+    fprintf(stderr, "Slower than %s or not in it\n", argv[5]);
+    return(1);
+  }
+
+  return(0);
+}
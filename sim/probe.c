@@ -0,0 +1,378 @@
+/*
+  ClockIt display probe
+
+  Runs clockit-text.elf in simavr, follows every change on PORTC and PORTD and works
+  out what the display really shows, at BRIGHT (a lit room, 12:34 PM) and at DIM (the dark, 11:34 PM):
+  - how often each digit is refreshed and the longest time it stays dark
+  - the duty of every segment on every digit
+  - ghost time, a segment lit on a digit while another pattern is meant to be showing
+    there, as happens when the segments and the digit select don't change together
+  - a sketch of the display, drawing each segment that is lit for a useful share of
+    the time
+
+  Each time a digit is selected, the lit pattern it shows longest is taken as the one
+  meant for it. Anything else lit during that select counts as ghost time.
+
+  The report is plain text, so a change in it shows up clearly when the file is
+  diffed. A VCD file of the pins can be written as well, for a waveform viewer. It has
+  the PB3 trace pin too, which is high while an interrupt runs when the firmware is
+  built with TRACE.
+
+  usage: probe mcu f_cpu clockit-text.elf clockit-text.sym seconds [pins.vcd] > probe.txt
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sim_avr.h>
+#include <sim_io.h>
+#include <avr_ioport.h>
+
+#include "sim.h"
+
+#define AM  1
+#define PM  2
+
+#define WARM_UP 4.1 //Seconds, so a light reading is taken before measuring
+#define BRIGHT_ROOM_US 1000 //LED discharge times, a lit room gives BRIGHT
+#define DARK_ROOM_US 0 //Never discharges, DIM
+#define SKETCH_DUTY 0.1 //Share of the brightest segment's duty a segment needs to be drawn
+
+//Digit select pins on PORTD (low to light) for digits 1-4 and the colon/AM dot
+#define DIGITS 5
+static const int digit_pins[DIGITS] = { 0, 1, 4, 6, 3 };
+static const char *digit_names[DIGITS] = { "1", "2", "3", "4", "colon" };
+
+//Segments in the order A-G then the decimal point, with their port and pin
+#define SEGMENTS 8
+enum { SEG_A, SEG_B, SEG_C, SEG_D, SEG_E, SEG_F, SEG_G, SEG_DP };
+static const char segment_names[SEGMENTS] = { 'A', 'B', 'C', 'D', 'E', 'F', 'G', '.' };
+static const char segment_ports[SEGMENTS] = { 'C', 'C', 'C', 'D', 'C', 'C', 'C', 'D' };
+static const int segment_pins[SEGMENTS] = { 3, 5, 2, 2, 0, 1, 4, 5 };
+
+//Names for the pins in the VCD file, - for the ones that aren't part of the display
+static const char *vcd_names[2][8] = {
+  { "seg_e", "seg_f", "seg_c", "seg_a", "seg_g", "seg_b", "-", "-" }, //PORTC
+  { "dig_1", "dig_2", "seg_d", "col", "dig_3", "seg_dp", "dig_4", "-" }, //PORTD
+};
+#define TRACE_PIN 3 //PORTB
+#define TRACE_VCD_ID 'q' //After the PORTC and PORTD ids
+
+struct digit {
+  avr_cycle_count_t on[SEGMENTS]; //Cycles each segment was lit
+  avr_cycle_count_t ghost; //Segment cycles lit outside the pattern meant for the digit
+  uint32_t refreshes; //Selects that lit something
+  avr_cycle_count_t dark_since;
+  avr_cycle_count_t longest_dark;
+
+  //Cycles spent on each pattern during the current select
+  avr_cycle_count_t pattern_cycles[256];
+  uint8_t patterns[256];
+  int pattern_count;
+  int selected;
+};
+
+struct probe {
+  avr_t *avr;
+  uint8_t portc, portd;
+  avr_cycle_count_t last_change;
+  struct digit digits[DIGITS];
+
+  FILE *vcd;
+  uint8_t vcd_ports[2];
+};
+
+static uint8_t segments_lit(struct probe *probe)
+{
+  uint8_t pattern = 0;
+
+  for(int segment = 0 ; segment < SEGMENTS ; segment++)
+  {
+    uint8_t port = (segment_ports[segment] == 'C') ? probe->portc : probe->portd;
+    if(port & (1 << segment_pins[segment])) pattern |= 1 << segment;
+  }
+  return(pattern);
+}
+
+static int popcount(uint8_t bits)
+{
+  int count = 0;
+
+  for( ; bits ; bits &= bits - 1) count++;
+  return(count);
+}
+
+//The digit has been deselected, so the pattern meant for it is the one it showed longest.
+//The firmware selects every digit while the display is dark, so dark doesn't count.
+static void end_select(struct probe *probe, struct digit *digit)
+{
+  uint8_t meant = 0;
+  avr_cycle_count_t longest = 0;
+
+  for(int i = 0 ; i < digit->pattern_count ; i++)
+  {
+    uint8_t pattern = digit->patterns[i];
+    if(pattern != 0 && digit->pattern_cycles[pattern] > longest)
+    {
+      longest = digit->pattern_cycles[pattern];
+      meant = pattern;
+    }
+  }
+
+  for(int i = 0 ; i < digit->pattern_count ; i++)
+  {
+    uint8_t pattern = digit->patterns[i];
+    digit->ghost += popcount(pattern & ~meant) * digit->pattern_cycles[pattern];
+    digit->pattern_cycles[pattern] = 0;
+  }
+  digit->pattern_count = 0;
+
+  if(meant != 0)
+  {
+    digit->refreshes++;
+    digit->dark_since = probe->avr->cycle;
+  }
+}
+
+static void write_vcd(struct probe *probe)
+{
+  uint8_t ports[2] = { probe->portc, probe->portd };
+
+  fprintf(probe->vcd, "#%llu\n", (unsigned long long)(probe->avr->cycle * 1000000000ULL / probe->avr->frequency));
+  for(int port = 0 ; port < 2 ; port++)
+  {
+    for(int pin = 0 ; pin < 8 ; pin++)
+    {
+      uint8_t bit = 1 << pin;
+      if(vcd_names[port][pin][0] != '-' && (ports[port] ^ probe->vcd_ports[port]) & bit)
+        fprintf(probe->vcd, "%d%c\n", (ports[port] & bit) != 0, 'a' + port * 8 + pin);
+    }
+    probe->vcd_ports[port] = ports[port];
+  }
+}
+
+static void port_changed(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+  struct probe *probe = param;
+  avr_cycle_count_t now = probe->avr->cycle;
+  uint8_t lit = segments_lit(probe);
+
+  //Everything up to now was lit the old way
+  for(int d = 0 ; d < DIGITS ; d++)
+  {
+    struct digit *digit = &probe->digits[d];
+
+    if(!digit->selected) continue;
+    for(int segment = 0 ; segment < SEGMENTS ; segment++)
+    {
+      if(lit & (1 << segment)) digit->on[segment] += now - probe->last_change;
+    }
+    if(digit->pattern_cycles[lit] == 0 && now != probe->last_change) digit->patterns[digit->pattern_count++] = lit;
+    digit->pattern_cycles[lit] += now - probe->last_change;
+  }
+  probe->last_change = now;
+
+  if(irq == avr_io_getirq(probe->avr, AVR_IOCTL_IOPORT_GETIRQ('C'), IOPORT_IRQ_PIN_ALL))
+    probe->portc = value;
+  else
+    probe->portd = value;
+
+  for(int d = 0 ; d < DIGITS ; d++)
+  {
+    struct digit *digit = &probe->digits[d];
+    int selected = (probe->portd & (1 << digit_pins[d])) == 0;
+
+    if(digit->selected && !selected) end_select(probe, digit);
+    if(!digit->selected && selected && digit->refreshes != 0 && now - digit->dark_since > digit->longest_dark)
+      digit->longest_dark = now - digit->dark_since;
+    digit->selected = selected;
+  }
+
+  if(probe->vcd != NULL) write_vcd(probe);
+}
+
+static void trace_changed(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+  struct probe *probe = param;
+
+  fprintf(probe->vcd, "#%llu\n%d%c\n", (unsigned long long)(probe->avr->cycle * 1000000000ULL / probe->avr->frequency),
+          value != 0, TRACE_VCD_ID);
+}
+
+static void clear_stats(struct probe *probe)
+{
+  for(int d = 0 ; d < DIGITS ; d++)
+  {
+    struct digit *digit = &probe->digits[d];
+
+    memset(digit->on, 0, sizeof(digit->on));
+    digit->ghost = 0;
+    digit->refreshes = 0;
+    digit->longest_dark = 0;
+  }
+  probe->last_change = probe->avr->cycle;
+}
+
+//Draw the display, three rows of text per digit
+static void sketch(struct probe *probe, double cycles)
+{
+  double brightest = 0;
+  char rows[3][32];
+
+  for(int d = 0 ; d < DIGITS ; d++)
+  {
+    for(int segment = 0 ; segment < SEGMENTS ; segment++)
+    {
+      if(probe->digits[d].on[segment] / cycles > brightest) brightest = probe->digits[d].on[segment] / cycles;
+    }
+  }
+
+  memset(rows, ' ', sizeof(rows));
+  for(int d = 0 ; d < DIGITS ; d++)
+  {
+    struct digit *digit = &probe->digits[d];
+    int lit[SEGMENTS];
+    char *top = rows[0], *middle = rows[1], *bottom = rows[2];
+    int column = (d < 2) ? d * 4 : d * 4 + 2; //Room for the colon between digits 2 and 3
+
+    for(int segment = 0 ; segment < SEGMENTS ; segment++)
+      lit[segment] = brightest > 0 && digit->on[segment] / cycles >= brightest * SKETCH_DUTY;
+
+    if(d == DIGITS - 1)
+    {
+      //Colon is A and B, the AM dot is C
+      if(lit[SEG_A]) middle[8] = '.';
+      if(lit[SEG_B]) bottom[8] = '.';
+      if(lit[SEG_C]) top[8] = '\'';
+      continue;
+    }
+
+    if(lit[SEG_A]) top[column + 1] = '_';
+    if(lit[SEG_F]) middle[column] = '|';
+    if(lit[SEG_G]) middle[column + 1] = '_';
+    if(lit[SEG_B]) middle[column + 2] = '|';
+    if(lit[SEG_E]) bottom[column] = '|';
+    if(lit[SEG_D]) bottom[column + 1] = '_';
+    if(lit[SEG_C]) bottom[column + 2] = '|';
+    if(lit[SEG_DP]) bottom[column + 3] = '.';
+  }
+
+  for(int row = 0 ; row < 3 ; row++)
+  {
+    int end = 18;
+    while(end > 0 && rows[row][end - 1] == ' ') end--;
+    printf("  %.*s\n", end, rows[row]);
+  }
+}
+
+static void report(struct probe *probe, const char *name, double seconds)
+{
+  double cycles = seconds * probe->avr->frequency;
+  double us_per_cycle = 1e6 / probe->avr->frequency;
+
+  printf("%s\n\n", name);
+  sketch(probe, cycles);
+
+  printf("\n%-6s %10s %10s", "digit", "refresh_hz", "dark_us");
+  for(int segment = 0 ; segment < SEGMENTS ; segment++) printf(" %7c", segment_names[segment]);
+  printf(" %10s\n", "ghost_us/s");
+
+  for(int d = 0 ; d < DIGITS ; d++)
+  {
+    struct digit *digit = &probe->digits[d];
+
+    printf("%-6s %10.1f %10.1f", digit_names[d], digit->refreshes / seconds, digit->longest_dark * us_per_cycle);
+    for(int segment = 0 ; segment < SEGMENTS ; segment++) printf(" %7.5f", digit->on[segment] / cycles);
+    printf(" %10.2f\n", digit->ghost * us_per_cycle / seconds);
+  }
+  printf("\n");
+}
+
+static void scenario(struct probe *probe, const char *name, uint8_t hours, uint8_t ampm, uint32_t light_us, double seconds)
+{
+  avr_t *avr = probe->avr;
+
+  //The next light reading picks the brightness, or the second tick from the time
+  //without LIGHT_SENSOR. A light_level of 0 takes the reading as it is, unfiltered.
+  *sim_data(avr, "hours") = hours;
+  *sim_data(avr, "minutes") = 34;
+  *sim_data(avr, "ampm") = ampm;
+  sim_set_light(avr, light_us);
+  memset(sim_data(avr, "light_level"), 0, 2);
+
+  sim_run(avr, WARM_UP * avr->frequency, NULL, NULL);
+
+  clear_stats(probe);
+  sim_run(avr, seconds * avr->frequency, NULL, NULL);
+  report(probe, name, seconds);
+}
+
+static void start_vcd(struct probe *probe, const char *file_name)
+{
+  probe->vcd = fopen(file_name, "w");
+  if(probe->vcd == NULL)
+  {
+    fprintf(stderr, "Can't write %s\n", file_name);
+    exit(1);
+  }
+
+  fprintf(probe->vcd, "$timescale 1ns $end\n$scope module clockit $end\n");
+  for(int port = 0 ; port < 2 ; port++)
+  {
+    for(int pin = 0 ; pin < 8 ; pin++)
+    {
+      if(vcd_names[port][pin][0] != '-')
+        fprintf(probe->vcd, "$var wire 1 %c %s $end\n", 'a' + port * 8 + pin, vcd_names[port][pin]);
+    }
+  }
+  fprintf(probe->vcd, "$var wire 1 %c trace $end\n", TRACE_VCD_ID);
+  fprintf(probe->vcd, "$upscope $end\n$enddefinitions $end\n");
+
+  //Start from everything low so the first change writes every pin
+  probe->vcd_ports[0] = probe->vcd_ports[1] = 0;
+  fprintf(probe->vcd, "#0\n$dumpvars\n");
+  for(int port = 0 ; port < 2 ; port++)
+  {
+    for(int pin = 0 ; pin < 8 ; pin++)
+    {
+      if(vcd_names[port][pin][0] != '-') fprintf(probe->vcd, "0%c\n", 'a' + port * 8 + pin);
+    }
+  }
+  fprintf(probe->vcd, "0%c\n$end\n", TRACE_VCD_ID);
+
+  avr_irq_register_notify(avr_io_getirq(probe->avr, AVR_IOCTL_IOPORT_GETIRQ('B'), TRACE_PIN), trace_changed, probe);
+}
+
+int main(int argc, char *argv[])
+{
+  struct probe *probe;
+  double seconds;
+
+  if(argc != 6 && argc != 7)
+  {
+    fprintf(stderr, "usage: %s mcu f_cpu clockit-text.elf clockit-text.sym seconds [pins.vcd]\n", argv[0]);
+    return(1);
+  }
+
+  probe = calloc(1, sizeof(*probe));
+  seconds = atof(argv[5]);
+
+  probe->avr = sim_load(argv[3], argv[1], strtoul(argv[2], NULL, 10));
+  sim_read_symbols(argv[4]);
+  sim_release_buttons(probe->avr, 1);
+  if(argc == 7) start_vcd(probe, argv[6]);
+
+  avr_irq_register_notify(avr_io_getirq(probe->avr, AVR_IOCTL_IOPORT_GETIRQ('C'), IOPORT_IRQ_PIN_ALL), port_changed, probe);
+  avr_irq_register_notify(avr_io_getirq(probe->avr, AVR_IOCTL_IOPORT_GETIRQ('D'), IOPORT_IRQ_PIN_ALL), port_changed, probe);
+
+  //Let the power up siren finish
+  sim_run(probe->avr, 1 * probe->avr->frequency, NULL, NULL);
+
+  printf("ClockIt display, %s at %s Hz, %g s each\n\n", argv[1], argv[2], seconds);
+  scenario(probe, "bright 12:34 PM", 12, PM, BRIGHT_ROOM_US, seconds);
+  scenario(probe, "dim 11:34 PM", 11, PM, DARK_ROOM_US, seconds);
+
+  if(probe->vcd != NULL) fclose(probe->vcd);
+  return(0);
+}
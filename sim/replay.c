@@ -0,0 +1,527 @@
+/*
+  ClockIt scenario replay
+
+  Builds clockit-text.c for the host against the stand-in headers in sim/host and runs
+  it with time moved on a millisecond at a time, as fast as the host can go, so a day
+  of clock time takes seconds. A script presses the buttons, flips the alarm switch
+  and checks what the clock does:
+
+    # comment
+    time 9:59:50 AM            set the clock
+    date 2024-02-28            set the date, 2000 to 2099
+    alarm 10:00 AM             set the alarm
+    switch on                  alarm switch on or off
+    press SNOOZE               hold UP, DOWN or SNOOZE down
+    release SNOOZE             let it go
+    at 10:00:03 AM [command]   wait for the clock to get to a time, then run command
+    wait 500 [command]         wait 500ms, then run command
+    expect buzzer on           the buzzer is sounding now, or off
+    expect alarm 10:00:00 AM   the buzzer last started up after a quiet spell at this time
+    expect display " 959"      digits 1 to 4 show this
+    expect date 2024-02-29 Thu the date and the weekday the clock has now
+    expect latency 30          the display changed within 30ms of the last press or release
+
+  Every command is printed with the clock time it ran at, and the firmware's energy
+  counters are printed at the end. The exit status is the number of checks that failed.
+  The host doesn't sleep, so the idle time always shows as 0.
+
+  Built with make replay TRACE=mask, a failed check also prints the firmware's trace of
+  the second tick and the tasks. Timer 2 and Timer 0 aren't run on the host.
+
+  usage: replay script
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define HOST_REGISTER(type, name) volatile type name;
+#include <avr/io.h>
+
+#include "../clockit-text.h" //flags, energy and the trace, as the firmware lays them out
+
+#define AM  1
+#define PM  2
+
+#define DAY_SECONDS 86400L
+#define ALARM_QUIET 2000 //ms of silence before the buzzer counts as a new alarm
+#define MAX_LINES 256
+#define MAX_LINE 128
+
+//Pins, matching clockit-text.c
+#define BUT_UP      5 //PINB
+#define BUT_DOWN    4 //PINB
+#define BUT_ALARM   0 //PINB
+#define BUT_SNOOZE  7 //PIND
+
+static const int digit_pins[5] = { 0, 1, 4, 6, 3 }; //PORTD, low to light
+#define SEG_D 2 //PORTD
+#define DP    5 //PORTD
+
+#define SEGMENT_D   0b10000000 //Glyph bits for the PORTD segments, as in clockit-text.c
+#define SEGMENT_DP  0b01000000
+
+//From the firmware
+extern uint8_t hours, minutes, seconds, ampm;
+extern uint8_t hours_alarm, minutes_alarm, ampm_alarm;
+extern uint8_t day, month, year, weekday;
+extern volatile uint8_t shown_frame;
+extern const char DIGITS[];
+extern const char CHARACTERS[];
+extern const char PUNCTUATION[];
+void update_time_str(void);
+uint8_t day_of_week(void);
+void TIMER1_COMPA_vect(void);
+void TIMER2_COMPA_vect(void);
+void TIMER2_COMPB_vect(void);
+int firmware_main(void);
+
+#ifdef TRACE
+#define TRACE_UNUSED 0xFF //Marks the records the firmware hasn't written yet
+
+static const char *trace_names[] = { "second", "slot", "dark", "tone", "light", "serial" };
+static const char *task_names[] = { "render", "buttons", "alarm", "countdown", "scroll", "repeat",
+                                    "blink", "siren", "stack", "energy", "light", "supply", "telemetry" };
+#endif
+
+static char lines[MAX_LINES][MAX_LINE];
+static int line_count;
+static int line_number; //Next line to run
+static const char *script_name;
+
+static uint64_t now; //ms since power up
+static uint32_t click_fraction; //Timer 1 clicks owed, in thousandths
+
+static uint8_t held; //Buttons down, bit per pin as PINB and PIND read them
+static int alarm_switch = 1;
+
+static int buzzer;
+static uint64_t buzzer_change;
+static long alarm_started = -1; //Clock time the buzzer last started after a quiet spell
+
+static uint8_t digits[5]; //Glyph shown on digits 1 to 4 and the colon
+static uint8_t last_frame = 0xFF;
+static uint64_t latency_from;
+static long latency = -1; //ms from the last press or release to the display changing
+
+static uint64_t wait_until;
+static long wait_time; //Clock time an at command is waiting for
+static const char *wait_rest; //Command to run once the wait is over
+static int waiting;
+
+static int checks, failures;
+
+static const char *weekday_names[7] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" }; //SUNDAY first
+
+static long clock_time(void)
+{
+  return((hours % 12 + (ampm == PM ? 12 : 0)) * 3600L + minutes * 60 + seconds);
+}
+
+static const char *format_time(long time)
+{
+  static char text[16];
+  int hour = time / 3600 % 12;
+
+  snprintf(text, sizeof(text), "%d:%02ld:%02ld %s", hour == 0 ? 12 : hour, time / 60 % 60, time % 60,
+           time >= DAY_SECONDS / 2 ? "PM" : "AM");
+  return(text);
+}
+
+//Reads "h:mm[:ss] AM|PM", returns the clock time or -1 and sets *rest past it
+static long parse_time(const char *text, const char **rest)
+{
+  int hour, minute, second = 0, length;
+  char half[3];
+
+  if(sscanf(text, "%d:%d:%d %2s%n", &hour, &minute, &second, half, &length) != 4)
+  {
+    second = 0;
+    if(sscanf(text, "%d:%d %2s%n", &hour, &minute, half, &length) != 3) return(-1);
+  }
+  if(hour < 1 || hour > 12 || minute > 59 || second > 59) return(-1);
+
+  *rest = text + length;
+  return((hour % 12 + (strcmp(half, "PM") == 0 ? 12 : 0)) * 3600L + minute * 60 + second);
+}
+
+//Reads "yyyy-mm-dd" into the firmware's date, returns 0 if it isn't one
+static int parse_date(const char *text, uint8_t *d, uint8_t *m, uint8_t *y)
+{
+  int year_ad, month_number, day_number;
+
+  if(sscanf(text, "%d-%d-%d", &year_ad, &month_number, &day_number) != 3) return(0);
+  if(year_ad < 2000 || year_ad > 2099 || month_number < 1 || month_number > 12 || day_number < 1 || day_number > 31)
+    return(0);
+
+  *d = day_number;
+  *m = month_number;
+  *y = year_ad - 2000;
+  return(1);
+}
+
+static void set_clock(long time, uint8_t *h, uint8_t *m, uint8_t *s, uint8_t *half)
+{
+  *h = time / 3600 % 12;
+  if(*h == 0) *h = 12;
+  *m = time / 60 % 60;
+  *s = time % 60;
+  *half = time >= DAY_SECONDS / 2 ? PM : AM;
+}
+
+static int button_pin(const char *name)
+{
+  if(strncmp(name, "UP", 2) == 0) return(BUT_UP);
+  if(strncmp(name, "DOWN", 4) == 0) return(BUT_DOWN);
+  if(strncmp(name, "SNOOZE", 6) == 0) return(BUT_SNOOZE);
+  return(-1);
+}
+
+//The pins read high unless a button pulls them down, the alarm switch is high when on
+static void drive_pins(void)
+{
+  PINB = 0xFF & ~((held & (1<<BUT_UP)) | (held & (1<<BUT_DOWN)));
+  if(!alarm_switch) PINB &= ~(1<<BUT_ALARM);
+  PIND = 0xFF & ~(held & (1<<BUT_SNOOZE));
+}
+
+static char glyph_text(uint8_t glyph)
+{
+  glyph &= ~SEGMENT_DP;
+
+  if(glyph == 0) return(' ');
+  for(int i = 0 ; i < 10 ; i++)
+    if((uint8_t)DIGITS[i] == glyph) return('0' + i);
+  for(int i = 0 ; i < 26 ; i++)
+    if((uint8_t)CHARACTERS[i] == glyph) return('A' + i);
+  if((uint8_t)PUNCTUATION[0] == glyph) return('-');
+  return('?');
+}
+
+static void display_text(char *text)
+{
+  for(int digit = 0 ; digit < 4 ; digit++) text[digit] = glyph_text(digits[digit]);
+  text[4] = 0;
+}
+
+//Light each slot of the frame the firmware has just finished and see what it shows
+static void read_display(void)
+{
+  uint8_t shown[5] = { 0 };
+  uint8_t start = GPIOR2; //frame_slot
+
+  do {
+    TIMER2_COMPA_vect();
+    for(int digit = 0 ; digit < 5 ; digit++)
+    {
+      if(PORTD & (1<<digit_pins[digit])) continue;
+      shown[digit] |= PORTC & 0b00111111;
+      if(PORTD & (1<<SEG_D)) shown[digit] |= SEGMENT_D;
+      if(PORTD & (1<<DP)) shown[digit] |= SEGMENT_DP;
+    }
+    TIMER2_COMPB_vect();
+  } while(GPIOR2 != start);
+
+  //The colon flashes every second, so only the digits count as a change
+  if(memcmp(shown, digits, 4) != 0 && latency < 0 && latency_from != 0)
+  {
+    latency = now - latency_from;
+    printf("                 display changed after %ldms\n", latency);
+  }
+  memcpy(digits, shown, sizeof(digits));
+}
+
+#ifdef TRACE
+//The trace leading up to now, oldest first, with the time into the second
+static void print_trace(void)
+{
+  for(int i = 0 ; i < TRACE_SIZE ; i++)
+  {
+    int event = trace[(trace_next + i) & (TRACE_SIZE - 1)].event;
+    int when = trace[(trace_next + i) & (TRACE_SIZE - 1)].when;
+    int id = event & ~TRACE_END;
+
+    if(event == TRACE_UNUSED) continue;
+    printf("  trace %7.3f  %s%s\n", when / (double)(OCR1A + 1),
+           id >= TRACE_TASK ? task_names[id - TRACE_TASK] : trace_names[id],
+           (event & TRACE_END) ? " end" : "");
+  }
+}
+#endif
+
+static void check(int passed, const char *fmt, const char *expected, const char *actual)
+{
+  checks++;
+  if(passed) return;
+
+  failures++;
+  printf("%s:%d: FAILED, expected ", script_name, line_number);
+  printf(fmt, expected);
+  printf(" but got ");
+  printf(fmt, actual);
+  printf("\n");
+#ifdef TRACE
+  print_trace();
+#endif
+}
+
+static void fail(const char *message)
+{
+  printf("%s:%d: %s\n", script_name, line_number, message);
+  exit(100);
+}
+
+static int run_command(const char *command);
+
+//Commands that wait return 0 until they are done
+static int run_wait(const char *command)
+{
+  int length;
+  unsigned ms;
+
+  //This is called every ms while waiting, so the command is only read the first time
+  if(!waiting)
+  {
+    waiting = 1;
+    wait_time = -1;
+
+    if(command[0] == 'a')
+    {
+      wait_time = parse_time(command + 3, &wait_rest);
+      if(wait_time < 0) fail("bad time");
+      wait_until = now + (DAY_SECONDS + 1) * 1000; //Every time comes round within a day
+    }
+    else
+    {
+      if(sscanf(command + 5, "%u%n", &ms, &length) != 1) fail("bad wait");
+      wait_rest = command + 5 + length;
+      wait_until = now + ms;
+    }
+  }
+
+  if(wait_time >= 0)
+  {
+    if(clock_time() != wait_time)
+    {
+      if(now >= wait_until) fail("the clock never got there");
+      return(0);
+    }
+  }
+  else if(now < wait_until)
+    return(0);
+
+  waiting = 0;
+  while(*wait_rest == ' ') wait_rest++;
+  if(*wait_rest != 0) run_command(wait_rest);
+  return(1);
+}
+
+static void run_expect(const char *what)
+{
+  char expected[20], actual[20];
+  const char *rest;
+  long time;
+  long ms;
+
+  if(strncmp(what, "buzzer ", 7) == 0)
+  {
+    check(strcmp(what + 7, buzzer ? "on" : "off") == 0, "buzzer %s", what + 7, buzzer ? "on" : "off");
+  }
+  else if(strncmp(what, "alarm ", 6) == 0)
+  {
+    time = parse_time(what + 6, &rest);
+    if(time < 0) fail("bad time");
+    snprintf(expected, sizeof(expected), "%s", format_time(time));
+    snprintf(actual, sizeof(actual), "%s", alarm_started < 0 ? "none" : format_time(alarm_started));
+    check(alarm_started == time, "alarm at %s", expected, actual);
+  }
+  else if(strncmp(what, "display ", 8) == 0)
+  {
+    if(sscanf(what + 8, "\"%15[^\"]\"", expected) != 1) fail("bad display text");
+    display_text(actual);
+    check(strcmp(expected, actual) == 0, "\"%s\"", expected, actual);
+  }
+  else if(strncmp(what, "date ", 5) == 0)
+  {
+    uint8_t d, m, y;
+    char name[4];
+
+    if(!parse_date(what + 5, &d, &m, &y) || sscanf(what + 5, "%*s %3s", name) != 1) fail("bad date");
+    snprintf(expected, sizeof(expected), "%04d-%02d-%02d %s", 2000 + y, m, d, name);
+    snprintf(actual, sizeof(actual), "%04d-%02d-%02d %s", 2000 + year, month, day,
+             weekday < 7 ? weekday_names[weekday] : "?");
+    check(strcmp(expected, actual) == 0, "%s", expected, actual);
+  }
+  else if(strncmp(what, "latency ", 8) == 0)
+  {
+    ms = atol(what + 8);
+    snprintf(expected, sizeof(expected), "%ld", ms);
+    snprintf(actual, sizeof(actual), "%ld", latency);
+    check(latency >= 0 && latency <= ms, "display change within %sms", expected, actual);
+  }
+  else
+    fail("unknown expect");
+}
+
+//Returns 0 while the command is waiting
+static int run_command(const char *command)
+{
+  const char *rest;
+  long time;
+  int pin;
+
+  if(*command == 0) return(1);
+
+  if(strncmp(command, "at ", 3) == 0 || strncmp(command, "wait ", 5) == 0)
+    return(run_wait(command));
+
+  printf("%-12s %7.3fs  %s\n", format_time(clock_time()), now / 1000.0, command);
+
+  if(strncmp(command, "time ", 5) == 0)
+  {
+    time = parse_time(command + 5, &rest);
+    if(time < 0) fail("bad time");
+    set_clock(time, &hours, &minutes, &seconds, &ampm);
+    update_time_str();
+  }
+  else if(strncmp(command, "date ", 5) == 0)
+  {
+    if(!parse_date(command + 5, &day, &month, &year)) fail("bad date");
+    weekday = day_of_week();
+  }
+  else if(strncmp(command, "alarm ", 6) == 0)
+  {
+    time = parse_time(command + 6, &rest);
+    if(time < 0) fail("bad time");
+    uint8_t alarm_seconds; //The alarm goes off on the minute
+    set_clock(time, &hours_alarm, &minutes_alarm, &alarm_seconds, &ampm_alarm);
+  }
+  else if(strncmp(command, "switch ", 7) == 0)
+  {
+    alarm_switch = strcmp(command + 7, "on") == 0;
+    drive_pins();
+  }
+  else if(strncmp(command, "press ", 6) == 0 || strncmp(command, "release ", 8) == 0)
+  {
+    int press = command[0] == 'p';
+
+    pin = button_pin(command + (press ? 6 : 8));
+    if(pin < 0) fail("unknown button");
+    if(press)
+      held |= (1<<pin);
+    else
+      held &= ~(1<<pin);
+    drive_pins();
+
+    latency_from = now;
+    latency = -1;
+  }
+  else if(strncmp(command, "expect ", 7) == 0)
+    run_expect(command + 7);
+  else
+    fail("unknown command");
+
+  return(1);
+}
+
+static void finish(void)
+{
+  printf("%s: lit %lu segment ms, buzzer %lu ms, powered %lu ms\n", script_name,
+         (unsigned long)energy.lit_segment_ms, (unsigned long)energy.buzzer_ms, (unsigned long)energy.on_ms);
+  printf("%s: %d checks, %d failed\n", script_name, checks, failures);
+  exit(failures);
+}
+
+//The firmware's main loop sleeps here, so this is where time moves on
+void host_sleep(void)
+{
+  int sounding;
+
+  now++;
+
+  //Timer 1 makes OCR1A + 1 clicks a second
+  click_fraction += OCR1A + 1;
+  TCNT1 += click_fraction / 1000;
+  click_fraction %= 1000;
+  if(TCNT1 > OCR1A)
+  {
+    TCNT1 -= OCR1A + 1;
+    if(TIMSK1 & (1<<OCIE1A)) TIMER1_COMPA_vect();
+  }
+
+  //The display goes dark while the firmware reads the room light, that isn't a change
+  if(shown_frame != last_frame)
+  {
+    last_frame = shown_frame;
+    if(!flags.light_sensing) read_display();
+  }
+
+  sounding = (TIMSK0 & (1<<OCIE0A)) != 0;
+  if(sounding != buzzer)
+  {
+    if(sounding && now - buzzer_change >= ALARM_QUIET)
+    {
+      alarm_started = clock_time();
+      printf("%-12s %7.3fs  buzzer starts\n", format_time(alarm_started), now / 1000.0);
+    }
+    buzzer = sounding;
+    buzzer_change = now;
+  }
+
+  while(line_number < line_count)
+  {
+    if(!run_command(lines[line_number])) return;
+    line_number++;
+  }
+
+  finish();
+}
+
+static void read_script(const char *file_name)
+{
+  FILE *file = fopen(file_name, "r");
+  char line[MAX_LINE];
+
+  if(file == NULL)
+  {
+    fprintf(stderr, "Can't read %s\n", file_name);
+    exit(100);
+  }
+
+  while(fgets(line, sizeof(line), file) != NULL)
+  {
+    char *start = line;
+    char *end = start + strcspn(start, "#\r\n");
+
+    while(*start == ' ') start++;
+    while(end > start && end[-1] == ' ') end--;
+    *end = 0;
+
+    //Keep blank lines so the line numbers in messages match the file
+    if(line_count == MAX_LINES) fail("script too long");
+    strcpy(lines[line_count++], start);
+  }
+
+  fclose(file);
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 2)
+  {
+    fprintf(stderr, "usage: %s script\n", argv[0]);
+    return(100);
+  }
+
+  script_name = argv[1];
+  read_script(script_name);
+  drive_pins();
+  ADC = 1100L * 1024 / 5000; //The bandgap read against a 5V supply
+#ifdef TRACE
+  for(int i = 0 ; i < TRACE_SIZE ; i++) trace[i].event = TRACE_UNUSED;
+#endif
+
+  firmware_main(); //Never returns, host_sleep() exits when the script is done
+  return(0);
+}
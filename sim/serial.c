@@ -0,0 +1,116 @@
+/*
+  ClockIt telemetry capture
+
+  Runs a TELEMETRY build of clockit-text.elf in simavr and reads PB3 the way a USB
+  serial adapter would: each fall from idle is a start bit, and the line is sampled in
+  the middle of each of the ten bit times that follow for the 8 data bits, low bit
+  first, and the stop bit. The bytes go to stdout as they were sent, ready for
+  tools/telemetry.py, and a count of them and of any without a stop bit to stderr.
+
+  The simulated supply is SIM_VCC_MV with the buttons up and the alarm switch on, so
+  the records show a clock left alone from power up.
+
+  usage: serial mcu f_cpu clockit-text.elf clockit-text.sym seconds > capture
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sim_avr.h>
+#include <sim_io.h>
+#include <avr_ioport.h>
+
+#include "sim.h"
+
+#define TELEMETRY_PIN 3 //PORTB, TELEMETRY_PIN in clockit-text.c
+#define BAUD 9600 //TELEMETRY_BAUD
+#define FRAME_BITS 10 //Start, 8 data and stop
+
+struct serial {
+  avr_t *avr;
+  double bit_cycles;
+  uint32_t level; //PB3 as last seen, starts low until the firmware raises it to idle
+  int receiving;
+  avr_cycle_count_t start; //Cycle the start bit fell on
+  int bit; //Next bit to sample, 0 is the start bit
+  uint8_t data;
+  unsigned long bytes;
+  unsigned long framing_errors;
+};
+
+//Sample every bit whose middle has gone by, with the line as it was since the last change
+static void sample_until(struct serial *serial, avr_cycle_count_t now)
+{
+  while(serial->receiving && serial->start + (serial->bit + 0.5) * serial->bit_cycles <= now)
+  {
+    if(serial->bit == 0)
+    {
+      if(serial->level != 0) serial->receiving = 0; //A glitch, not a start bit
+    }
+    else if(serial->bit < FRAME_BITS - 1)
+    {
+      serial->data >>= 1;
+      if(serial->level != 0) serial->data |= 0x80;
+    }
+    else
+    {
+      if(serial->level != 0)
+      {
+        putchar(serial->data);
+        serial->bytes++;
+      }
+      else
+        serial->framing_errors++;
+      serial->receiving = 0;
+    }
+    serial->bit++;
+  }
+}
+
+static void pin_changed(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+  struct serial *serial = param;
+
+  value = (value != 0);
+  sample_until(serial, serial->avr->cycle);
+
+  if(!serial->receiving && serial->level == 1 && value == 0)
+  {
+    serial->receiving = 1;
+    serial->start = serial->avr->cycle;
+    serial->bit = 0;
+    serial->data = 0;
+  }
+  serial->level = value;
+}
+
+int main(int argc, char *argv[])
+{
+  struct serial *serial;
+  double seconds;
+
+  if(argc != 6)
+  {
+    fprintf(stderr, "usage: %s mcu f_cpu clockit-text.elf clockit-text.sym seconds > capture\n", argv[0]);
+    return(1);
+  }
+
+  serial = calloc(1, sizeof(*serial));
+  seconds = atof(argv[5]);
+
+  serial->avr = sim_load(argv[3], argv[1], strtoul(argv[2], NULL, 10));
+  sim_read_symbols(argv[4]);
+  sim_symbol("telemetry"); //Stops here on a build without TELEMETRY
+  sim_release_buttons(serial->avr, 1);
+  serial->bit_cycles = (double)serial->avr->frequency / BAUD;
+
+  avr_irq_register_notify(avr_io_getirq(serial->avr, AVR_IOCTL_IOPORT_GETIRQ('B'), TELEMETRY_PIN), pin_changed, serial);
+
+  sim_run(serial->avr, seconds * serial->avr->frequency, NULL, NULL);
+  sample_until(serial, serial->avr->cycle);
+  fflush(stdout);
+
+  fprintf(stderr, "%lu bytes, %lu without a stop bit\n", serial->bytes, serial->framing_errors);
+  return(0);
+}
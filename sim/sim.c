@@ -0,0 +1,218 @@
+/*
+  Shared simavr set up for the ClockIt simulator tools.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sim_avr.h>
+#include <sim_elf.h>
+#include <sim_io.h>
+#include <avr_ioport.h>
+
+#include "sim.h"
+
+#define MAX_SYMBOLS 512
+
+struct symbol {
+  char name[64];
+  uint32_t address;
+};
+
+static struct symbol symbols[MAX_SYMBOLS];
+static int symbol_count;
+
+avr_t *sim_load(const char *elf_file, const char *mcu, uint32_t frequency)
+{
+  elf_firmware_t firmware;
+  avr_t *avr;
+
+  memset(&firmware, 0, sizeof(firmware));
+  if(elf_read_firmware(elf_file, &firmware) != 0)
+  {
+    fprintf(stderr, "Can't read %s\n", elf_file);
+    exit(1);
+  }
+
+  //The firmware doesn't carry an .mmcu section, so the Makefile tells us
+  strncpy(firmware.mmcu, mcu, sizeof(firmware.mmcu) - 1);
+  firmware.frequency = frequency;
+
+  avr = avr_make_mcu_by_name(mcu);
+  if(avr == NULL)
+  {
+    fprintf(stderr, "simavr doesn't know the %s\n", mcu);
+    exit(1);
+  }
+
+  avr_init(avr);
+  avr_load_firmware(avr, &firmware);
+  avr->frequency = frequency;
+  avr->vcc = avr->avcc = SIM_VCC_MV; //The ADC reads the bandgap against AVCC
+
+  return(avr);
+}
+
+//Reads the "avr-nm -n" output written by "make sym"
+void sim_read_symbols(const char *sym_file)
+{
+  FILE *file = fopen(sym_file, "r");
+  char line[128];
+
+  if(file == NULL)
+  {
+    fprintf(stderr, "Can't read %s, run make sym\n", sym_file);
+    exit(1);
+  }
+
+  while(fgets(line, sizeof(line), file) != NULL && symbol_count < MAX_SYMBOLS)
+  {
+    struct symbol *symbol = &symbols[symbol_count];
+    char type;
+
+    if(sscanf(line, "%x %c %63s", &symbol->address, &type, symbol->name) == 3)
+      symbol_count++;
+  }
+
+  fclose(file);
+}
+
+uint32_t sim_symbol(const char *name)
+{
+  for(int i = 0 ; i < symbol_count ; i++)
+  {
+    if(strcmp(symbols[i].name, name) == 0) return(symbols[i].address);
+  }
+
+  fprintf(stderr, "No symbol %s in the firmware\n", name);
+  exit(1);
+}
+
+//Firmware variable in the simulated SRAM. avr-nm shows data addresses offset by 0x800000.
+uint8_t *sim_data(avr_t *avr, const char *name)
+{
+  return(&avr->data[sim_symbol(name) & 0xFFFF]);
+}
+
+void sim_set_pin(avr_t *avr, char port, int pin, int value)
+{
+  avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(port), pin), value);
+}
+
+//Nothing drives the button pins in the simulator, so pull them up like the real pull-ups would
+void sim_release_buttons(avr_t *avr, int alarm_on)
+{
+  sim_set_pin(avr, SIM_BUT_UP, 1);
+  sim_set_pin(avr, SIM_BUT_DOWN, 1);
+  sim_set_pin(avr, SIM_BUT_SNOOZE, 1);
+  sim_set_pin(avr, SIM_BUT_ALARM, alarm_on);
+}
+
+static uint32_t light_us; //How long the digit 4 LEDs take to discharge, 0 in the dark
+static int light_floating;
+
+static avr_cycle_count_t light_discharged(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+  sim_set_pin(avr, SIM_DIG_4, 0);
+  return(0);
+}
+
+//The firmware reads the room light by letting DIG_4 float, see read_light() in clockit-text.c
+static void light_direction(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+  avr_t *avr = param;
+  int floating = (value & (1<<6)) == 0;
+
+  if(floating == light_floating) return;
+  light_floating = floating;
+
+  if(!floating)
+  {
+    avr_cycle_timer_cancel(avr, light_discharged, NULL);
+    return;
+  }
+
+  sim_set_pin(avr, SIM_DIG_4, 1); //Charged up backwards
+  if(light_us != 0) avr_cycle_timer_register_usec(avr, light_us, light_discharged, NULL);
+}
+
+//Set how bright the room is, as the time the LEDs take to discharge
+void sim_set_light(avr_t *avr, uint32_t discharge_us)
+{
+  static int hooked;
+
+  if(!hooked)
+  {
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), IOPORT_IRQ_DIRECTION_ALL),
+                            light_direction, avr);
+    hooked = 1;
+  }
+  light_us = discharge_us;
+}
+
+//Run for cycles more cycles, calling step after every instruction if it isn't NULL
+void sim_run(avr_t *avr, avr_cycle_count_t cycles, void (*step)(avr_t *avr, void *param), void *param)
+{
+  avr_cycle_count_t end = avr->cycle + cycles;
+
+  while(avr->cycle < end)
+  {
+    int state = avr_run(avr);
+
+    if(state == cpu_Done || state == cpu_Crashed)
+    {
+      fprintf(stderr, "Firmware stopped at pc 0x%04x\n", (unsigned)avr->pc);
+      exit(1);
+    }
+
+    if(step != NULL) step(avr, param);
+  }
+}
+
+//Call a firmware function at the byte address from the symbol table and return the cycles
+//from its first instruction up to and including its ret. Interrupts are turned off so they
+//don't count. The arguments go in r24:r25, r22:r23 and r20:r21 the way avr-gcc passes them.
+avr_cycle_count_t sim_call(avr_t *avr, uint32_t function, uint16_t arg0, uint16_t arg1, uint16_t arg2)
+{
+  uint16_t sp = avr->data[R_SPL] | avr->data[R_SPH] << 8;
+  uint16_t return_word = avr->pc >> 1; //Never run, the call ends when the ret pops it
+  avr_cycle_count_t start;
+
+  avr->data[1] = 0; //avr-gcc keeps r1 zero
+  avr->data[24] = arg0;
+  avr->data[25] = arg0 >> 8;
+  avr->data[22] = arg1;
+  avr->data[23] = arg1 >> 8;
+  avr->data[20] = arg2;
+  avr->data[21] = arg2 >> 8;
+  avr->sreg[S_I] = 0;
+
+  //Push the return address like a call does, low byte first
+  avr->data[sp] = return_word;
+  avr->data[sp - 1] = return_word >> 8;
+  avr->data[R_SPL] = sp - 2;
+  avr->data[R_SPH] = (sp - 2) >> 8;
+
+  avr->pc = function;
+  avr->state = cpu_Running;
+  start = avr->cycle;
+
+  while((avr->data[R_SPL] | avr->data[R_SPH] << 8) != sp)
+  {
+    int state = avr_run(avr);
+    if(state == cpu_Done || state == cpu_Crashed)
+    {
+      fprintf(stderr, "Firmware stopped at pc 0x%04x\n", (unsigned)avr->pc);
+      exit(1);
+    }
+  }
+
+  return(avr->cycle - start);
+}
+
+//Word in the program memory, for reading PROGMEM tables
+uint16_t sim_flash_word(avr_t *avr, uint32_t address)
+{
+  return(avr->flash[address] | avr->flash[address + 1] << 8);
+}
@@ -0,0 +1,34 @@
+/*
+  Shared simavr set up for the ClockIt simulator tools.
+
+  The tools load clockit-text.elf into simavr and find the firmware's variables
+  through the symbol table that "make sym" writes (clockit-text.sym).
+*/
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <sim_avr.h>
+
+//Port pins, matching clockit-text.c
+#define SIM_BUT_UP      'B', 5
+#define SIM_BUT_DOWN    'B', 4
+#define SIM_BUT_SNOOZE  'D', 7
+#define SIM_BUT_ALARM   'B', 0
+#define SIM_DIG_4       'D', 6 //Also the light sensor
+
+#define SIM_VCC_MV 5000
+
+avr_t *sim_load(const char *elf_file, const char *mcu, uint32_t frequency);
+void sim_read_symbols(const char *sym_file);
+uint32_t sim_symbol(const char *name);
+uint8_t *sim_data(avr_t *avr, const char *name);
+void sim_set_pin(avr_t *avr, char port, int pin, int value);
+void sim_release_buttons(avr_t *avr, int alarm_on);
+void sim_set_light(avr_t *avr, uint32_t discharge_us);
+void sim_run(avr_t *avr, avr_cycle_count_t cycles, void (*step)(avr_t *avr, void *param), void *param);
+avr_cycle_count_t sim_call(avr_t *avr, uint32_t function, uint16_t arg0, uint16_t arg1, uint16_t arg2);
+uint16_t sim_flash_word(avr_t *avr, uint32_t address);
+
+#endif
@@ -0,0 +1,152 @@
+#!/usr/bin/env python3
+"""Check the interrupt handlers in the compiled firmware.
+
+usage: isr.py clockit-text.lss [NAME=cycles...]
+
+Reads the .lss listing avr-objdump writes and checks two things the timing of the
+display depends on:
+
+- Each handler named with a budget, e.g. TIMER2_COMPB=19, that runs straight from
+  its vector to reti without a branch has its cycles added up, from the jmp or rjmp
+  in the vector table to the end of reti. It must come within the budget. Handlers
+  with branches are left to make bench, which measures them.
+- Outside the interrupt handlers GPIOR0, where the hot flags are, may only be
+  changed with sbi and cbi. An out or sts to it reads, changes and writes the whole
+  byte and could undo a flag an interrupt set in between.
+
+The exit status is 1 if either check fails. A named handler that isn't in the
+listing, like PCINT2 without LIGHT_SENSOR, is only reported.
+"""
+
+import os
+import re
+import sys
+
+LABEL = re.compile(r'^([0-9a-f]+) <([\w.]+)>:$')
+INSTRUCTION = re.compile(r'^\s*([0-9a-f]+):\t(?:[0-9a-f]{2} )+\s*\t(\w+)\s*(.*)$')
+
+HEADER = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'clockit-text.h')
+
+
+def hot_flags_io():
+  #HOT_FLAGS_IO from clockit-text.h, which the firmware checks is GPIOR0
+  for line in open(HEADER):
+    define = re.match(r'#define HOT_FLAGS_IO (0x[0-9A-Fa-f]+)', line)
+    if define:
+      return int(define.group(1), 16)
+  raise SystemExit('No HOT_FLAGS_IO in %s' % HEADER)
+
+
+GPIOR0_IO = hot_flags_io()
+GPIOR0_DATA = GPIOR0_IO + 0x20
+
+#Same vector table for the atmega88, atmega168 and atmega328p, as in sim/bench.c
+VECTOR_NAMES = (
+  'RESET', 'INT0', 'INT1', 'PCINT0', 'PCINT1', 'PCINT2', 'WDT',
+  'TIMER2_COMPA', 'TIMER2_COMPB', 'TIMER2_OVF', 'TIMER1_CAPT', 'TIMER1_COMPA',
+  'TIMER1_COMPB', 'TIMER1_OVF', 'TIMER0_COMPA', 'TIMER0_COMPB', 'TIMER0_OVF',
+  'SPI_STC', 'USART_RX', 'USART_UDRE', 'USART_TX', 'ADC', 'EE_READY',
+  'ANALOG_COMP', 'TWI', 'SPM_READY',
+)
+
+#Cycles on a part with a 16 bit program counter, everything else takes 1
+CYCLES = {
+  'push': 2, 'pop': 2, 'ld': 2, 'ldd': 2, 'st': 2, 'std': 2, 'lds': 2, 'sts': 2,
+  'adiw': 2, 'sbiw': 2, 'mul': 2, 'muls': 2, 'mulsu': 2, 'fmul': 2, 'fmuls': 2, 'fmulsu': 2,
+  'sbi': 2, 'cbi': 2, 'lpm': 3, 'elpm': 3, 'rjmp': 2, 'jmp': 3, 'ijmp': 2,
+  'rcall': 3, 'call': 4, 'icall': 3, 'ret': 4, 'reti': 4,
+}
+BRANCHES = re.compile(r'^(br\w+|sbrc|sbrs|sbic|sbis|cpse|r?jmp|ijmp|r?call|icall|ret)$')
+
+
+def read_listing(name):
+  functions = {}
+  function = None
+  for line in open(name):
+    label = LABEL.match(line)
+    if label:
+      function = label.group(2)
+      functions[function] = []
+      continue
+    instruction = INSTRUCTION.match(line)
+    if instruction and function is not None:
+      address, mnemonic, operands = instruction.groups()
+      functions[function].append((int(address, 16), mnemonic, operands.split(';')[0].strip()))
+  return functions
+
+
+def vector_entry(functions, vector):
+  #Each entry is one jmp (4 bytes) on the atmega168 and atmega328p, one rjmp (2) on the atmega88
+  table = functions.get('__vectors', [])
+  if len(table) < 2:
+    return None
+  size = table[1][0] - table[0][0]
+  for address, mnemonic, operands in table:
+    if address == vector * size:
+      return mnemonic
+  return None
+
+
+def count_handler(functions, name):
+  vector = VECTOR_NAMES.index(name)
+  body = functions.get('__vector_%d' % vector)
+  entry = vector_entry(functions, vector)
+  if body is None or entry is None:
+    return None, '%s_vect is not in the listing' % name
+
+  cycles = CYCLES.get(entry, 1)
+  for address, mnemonic, operands in body:
+    cycles += CYCLES.get(mnemonic, 1)
+    if mnemonic == 'reti':
+      return cycles, None
+    if BRANCHES.match(mnemonic):
+      return None, '%s_vect branches, make bench measures it' % name
+  return None, '%s_vect has no reti' % name
+
+
+def gpior0_writes(functions):
+  writes = []
+  for function, body in sorted(functions.items()):
+    if function.startswith('__vector_'):
+      continue
+    for address, mnemonic, operands in body:
+      target = operands.split(',')[0].strip()
+      if target.startswith('0x'):
+        target = int(target, 16)
+        if (mnemonic == 'out' and target == GPIOR0_IO) or (mnemonic == 'sts' and target == GPIOR0_DATA):
+          writes.append('%s+0x%x: %s %s' % (function, address - body[0][0], mnemonic, operands))
+  return writes
+
+
+def main(args):
+  if not args:
+    sys.stderr.write(__doc__)
+    return 1
+
+  functions = read_listing(args[0])
+  failed = 0
+
+  for arg in args[1:]:
+    name, budget = arg.split('=')
+    if name not in VECTOR_NAMES:
+      sys.stderr.write('Bad interrupt budget %s\n' % arg)
+      return 1
+    cycles, why = count_handler(functions, name)
+    if cycles is None:
+      print('%-16s %s' % (name, why))
+      continue
+    over = cycles > int(budget)
+    print('%-16s %3d cycles, budget %s%s' % (name, cycles, budget, '  OVER' if over else ''))
+    failed += over
+
+  writes = gpior0_writes(functions)
+  for write in writes:
+    print('GPIOR0 written whole by %s' % write)
+  if not writes:
+    print('GPIOR0 only changed with sbi and cbi outside the interrupts')
+
+  return 1 if failed or writes else 0
+
+
+if __name__ == '__main__':
+  sys.exit(main(sys.argv[1:]))
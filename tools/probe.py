@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+"""Compare a make probe report with the reference one.
+
+usage: probe.py reference report [tolerance]
+
+Reads the digit tables of both reports: refresh rate, longest dark time, the duty of
+each segment and the ghost time, for each digit in each scenario. Every figure that
+has moved by more than tolerance percent (2 by default) is listed on stderr, along
+with any row one report has and the other doesn't. Changes below the last decimal
+place the reference shows are rounding and don't count. Lines starting with # are
+skipped, and a #made with line naming the compiler is repeated if anything changed.
+
+The exit status is 1 if anything changed that much or the reference can't be read.
+"""
+
+import re
+import sys
+
+NUMBER = r'-?\d+(?:\.\d+)?'
+ROW = re.compile(r'^(\S+)((?:\s+%s)+)$' % NUMBER)
+
+
+def read_report(name):
+  tables = {}
+  columns = []
+  scenario = None
+  made_with = None
+  for line in open(name):
+    line = line.rstrip()
+    if line.startswith('#made with '):
+      made_with = line[len('#made with '):]
+    if not line or line[0] in ' #' or line.startswith('ClockIt'):
+      continue
+    if line.startswith('digit '):
+      columns = line.split()[1:]
+      continue
+    row = ROW.match(line)
+    if row and columns:
+      for column, value in zip(columns, row.group(2).split()):
+        tables[scenario, row.group(1), column] = value
+    else:
+      scenario = line
+  return tables, made_with
+
+
+def rounding(value):
+  decimals = len(value.split('.')[1]) if '.' in value else 0
+  return 10 ** -decimals
+
+
+def compare(reference, report, tolerance):
+  changes = []
+  for key in sorted(set(reference) | set(report), key=str):
+    scenario, digit, column = key
+    where = '%s, digit %s, %s' % (scenario, digit, column)
+    if key not in reference or key not in report:
+      changes.append('%-48s only in %s' % (where, 'the report' if key in report else 'the reference'))
+      continue
+    was, now = float(reference[key]), float(report[key])
+    if abs(now - was) > max(abs(was) * tolerance / 100, rounding(reference[key])):
+      changes.append('%-48s %12s %12s' % (where, report[key], reference[key]))
+
+  if changes:
+    sys.stderr.write('%-48s %12s %12s\n' % ('figure', 'now', 'was'))
+    sys.stderr.write('\n'.join(changes) + '\n')
+  return len(changes)
+
+
+def main(args):
+  if len(args) not in (2, 3):
+    sys.stderr.write(__doc__)
+    return 1
+
+  tolerance = float(args[2]) if len(args) == 3 else 2
+  try:
+    reference, made_with = read_report(args[0])
+  except OSError:
+    sys.stderr.write('No reference in %s, run make probe-baseline and commit it\n' % args[0])
+    return 1
+
+  report = read_report(args[1])[0]
+  if not reference:
+    sys.stderr.write('No digit tables in %s\n' % args[0])
+    return 1
+
+  if compare(reference, report, tolerance):
+    sys.stderr.write('The display has changed from %s by more than %g%%\n' % (args[0], tolerance))
+    if made_with:
+      sys.stderr.write('%s was made with %s\n' % (args[0], made_with))
+    return 1
+  return 0
+
+
+if __name__ == '__main__':
+  sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+"""RAM the firmware takes before the stack, by section and by variable.
+
+usage: avr-nm -S -n clockit-text.elf | ram.py [baseline]
+
+Reads the symbol table with sizes on stdin. The sections are measured from the
+__data_start, __bss_start and __noinit_start symbols the linker script
+provides, so .data includes the string literals and other data that have no
+symbol of their own. They are listed as (unnamed).
+
+The report goes to stdout. Given a baseline written by an earlier run, the
+change in each section and in each variable that changed goes to stderr, and
+the exit status is 1 if the baseline can't be read.
+"""
+
+import re
+import sys
+
+SYMBOL = re.compile(r'^([0-9a-f]+) (?:([0-9a-f]+) )?(\w) ([\w.]+)$')
+SECTIONS = ('.data', '.bss', '.noinit')
+RAM_START = 0x800000 #Data addresses in the elf, flash is below and the EEPROM above
+RAM_END = 0x810000
+
+
+def read_symbols(lines):
+  bounds = {}
+  variables = []
+  for line in lines:
+    symbol = SYMBOL.match(line.strip())
+    if not symbol:
+      continue
+    address, size, kind, name = symbol.groups()
+    address = int(address, 16)
+    for section in SECTIONS:
+      for end in ('start', 'end'):
+        if name == '__%s_%s' % (section[1:], end):
+          bounds[section, end] = address
+    if size is not None and RAM_START <= address < RAM_END:
+      variables.append((address, int(size, 16), name))
+  return bounds, variables
+
+
+def measure(bounds, variables):
+  sections = {}
+  sizes = {}
+  for section in SECTIONS:
+    start, end = bounds.get((section, 'start')), bounds.get((section, 'end'))
+    if start is None or end is None:
+      continue
+    sections[section] = end - start
+    named = 0
+    for address, size, name in variables:
+      if start <= address < end:
+        sizes[name] = (section, size)
+        named += size
+    if named < sections[section]:
+      sizes['(unnamed)' + section] = (section, sections[section] - named)
+  return sections, sizes
+
+
+def report(sections, sizes):
+  print('#%-23s %6s' % ('section', 'bytes'))
+  for section in SECTIONS:
+    if section in sections:
+      print('%-24s %6d' % (section, sections[section]))
+  print('%-24s %6d' % ('total', sum(sections.values())))
+  print()
+  print('#%-23s %-8s %6s' % ('variable', 'section', 'bytes'))
+  for name in sorted(sizes, key=lambda name: (-sizes[name][1], name)):
+    print('%-24s %-8s %6d' % (name.split('.')[0] if name.startswith('(') else name, sizes[name][0], sizes[name][1]))
+
+
+def read_baseline(name):
+  sections = {}
+  sizes = {}
+  for line in open(name):
+    fields = line.split()
+    if not fields or fields[0].startswith('#'):
+      continue
+    if len(fields) == 2:
+      sections[fields[0]] = int(fields[1])
+    elif len(fields) == 3:
+      key = fields[0] + fields[1] if fields[0] == '(unnamed)' else fields[0]
+      sizes[key] = (fields[1], int(fields[2]))
+  return sections, sizes
+
+
+def compare(sections, sizes, baseline):
+  try:
+    was_sections, was_sizes = read_baseline(baseline)
+  except OSError:
+    sys.stderr.write('No baseline in %s, run make ram-baseline and commit it\n' % baseline)
+    return False
+
+  sections = dict(sections, total=sum(sections.values()))
+  sys.stderr.write('%-24s %6s %6s %6s\n' % ('section', 'now', 'was', 'change'))
+  for section in SECTIONS + ('total',):
+    now, was = sections.get(section, 0), was_sections.get(section, 0)
+    sys.stderr.write('%-24s %6d %6d %+6d\n' % (section, now, was, now - was))
+
+  changed = sorted(set(sizes) | set(was_sizes))
+  changed = [name for name in changed if sizes.get(name) != was_sizes.get(name)]
+  if changed:
+    sys.stderr.write('\n%-24s %6s %6s\n' % ('variable', 'now', 'was'))
+  for name in changed:
+    now = sizes[name][1] if name in sizes else 0
+    was = was_sizes[name][1] if name in was_sizes else 0
+    sys.stderr.write('%-24s %6d %6d\n' % (name.replace(')', ') ', 1), now, was))
+  return True
+
+
+def main(args):
+  if len(args) > 1:
+    sys.stderr.write(__doc__)
+    return 1
+
+  bounds, variables = read_symbols(sys.stdin)
+  if not any(end == 'end' for section, end in bounds):
+    sys.stderr.write('No section symbols on stdin, is it the output of avr-nm -S -n?\n')
+    return 1
+
+  sections, sizes = measure(bounds, variables)
+  report(sections, sizes)
+  if args and not compare(sections, sizes, args[0]):
+    return 1
+  return 0
+
+
+if __name__ == '__main__':
+  sys.exit(main(sys.argv[1:]))
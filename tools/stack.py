@@ -0,0 +1,149 @@
+#!/usr/bin/env python3
+"""Worst case stack depth of the firmware.
+
+usage: stack.py clockit-text.lss clockit-text.sym file.su... [--indirect caller=callee,...]
+
+Frame sizes come from the .su files gcc writes with -fstack-usage. On the AVR
+they include the return address and the registers the function pushes. The
+call graph comes from the call, rcall and tail call jumps in the .lss listing.
+Calls through function pointers (icall) are not in the listing, so name their
+targets with --indirect, e.g. --indirect run_tasks=render_display,check_buttons
+
+Interrupts are not nested: every handler runs with interrupts off, so the worst
+case is the deepest path from main plus the deepest handler.
+"""
+
+import re
+import sys
+
+LABEL = re.compile(r'^[0-9a-f]+ <([\w.]+)>:$')
+CALL = re.compile(r'^\s*[0-9a-f]+:\t(?:[0-9a-f]{2} )+\s*\t(r?call|r?jmp)\t.*<([\w.]+)(\+0x[0-9a-f]+)?>')
+ICALL = re.compile(r'^\s*[0-9a-f]+:\t(?:[0-9a-f]{2} )+\s*\te?icall')
+SYMBOL = re.compile(r'^([0-9a-f]+) \w ([\w.]+)$')
+
+LIBRARY_FRAME = 2 #Just the return address for library code without .su data
+
+
+def read_su(names):
+  frames = {}
+  qualifiers = {}
+  for name in names:
+    for line in open(name):
+      where, size, qualifier = line.rstrip('\n').split('\t')
+      function = where.split(':')[-1]
+      frames[function] = int(size)
+      qualifiers[function] = qualifier
+  return frames, qualifiers
+
+
+def read_calls(name):
+  calls = {}
+  indirect = set()
+  function = None
+  for line in open(name):
+    label = LABEL.match(line)
+    if label:
+      function = label.group(1)
+      calls.setdefault(function, set())
+      continue
+    if function is None:
+      continue
+    call = CALL.match(line)
+    if call:
+      kind, target, offset = call.groups()
+      #A jump to the start of another function is a tail call, anything else stays inside this one
+      if kind.endswith('call') or (offset is None and target != function):
+        calls[function].add(target)
+    elif ICALL.match(line):
+      indirect.add(function)
+  return calls, indirect
+
+
+def read_symbols(name):
+  symbols = {}
+  for line in open(name):
+    symbol = SYMBOL.match(line.strip())
+    if symbol:
+      symbols[symbol.group(2)] = int(symbol.group(1), 16) & 0xFFFF
+  return symbols
+
+
+def main(args):
+  indirect_targets = {}
+  files = []
+  while args:
+    arg = args.pop(0)
+    if arg == '--indirect':
+      caller, callees = args.pop(0).split('=')
+      indirect_targets[caller] = set(callees.split(','))
+    else:
+      files.append(arg)
+
+  if len(files) < 3:
+    sys.stderr.write(__doc__)
+    return 1
+
+  frames, qualifiers = read_su(files[2:])
+  calls, indirect = read_calls(files[0])
+  symbols = read_symbols(files[1])
+
+  for caller, callees in indirect_targets.items():
+    calls.setdefault(caller, set()).update(callees)
+
+  unknown = set()
+  recursive = set()
+  worst = {}
+
+  def depth(function, path):
+    if function in path:
+      recursive.add(function)
+      return 0, [function]
+    if function in worst:
+      return worst[function]
+    if function not in frames:
+      unknown.add(function)
+    deepest, deepest_path = 0, []
+    for callee in sorted(calls.get(function, ())):
+      callee_depth, callee_path = depth(callee, path + [function])
+      if callee_depth > deepest:
+        deepest, deepest_path = callee_depth, callee_path
+    worst[function] = (frames.get(function, LIBRARY_FRAME) + deepest, [function] + deepest_path)
+    return worst[function]
+
+  main_depth, main_path = depth('main', [])
+  handlers = sorted(f for f in frames if f.startswith('__vector_'))
+  handler_depth, handler_path = 0, []
+  for handler in handlers:
+    handler_worst = depth(handler, [])
+    if handler_worst[0] > handler_depth:
+      handler_depth, handler_path = handler_worst
+
+  print('%-24s %6s %6s  %s' % ('function', 'frame', 'worst', 'deepest calls'))
+  for function in sorted(worst, key=lambda f: -worst[f][0]):
+    frame = frames.get(function)
+    note = ' (%s)' % qualifiers[function] if qualifiers.get(function, 'static') != 'static' else ''
+    print('%-24s %6s %6d  %s%s' % (function, frame if frame is not None else '?', worst[function][0],
+                                   ' > '.join(worst[function][1][1:]), note))
+
+  total = main_depth + handler_depth
+  print()
+  print('main       %4d  %s' % (main_depth, ' > '.join(main_path)))
+  print('interrupt  %4d  %s' % (handler_depth, ' > '.join(handler_path)))
+  print('worst case %4d bytes' % total)
+
+  if '_end' in symbols and '__stack' in symbols:
+    free = symbols['__stack'] + 1 - symbols['_end']
+    print('RAM free   %4d bytes after .data and .bss, %d to spare' % (free, free - total))
+
+  for function in sorted(indirect - set(indirect_targets)):
+    print('warning: %s calls through a pointer, list the targets with --indirect' % function)
+  for function in sorted(unknown):
+    print('warning: no stack data for %s, counted as %d bytes' % (function, LIBRARY_FRAME))
+  for function in sorted(recursive):
+    print('warning: %s is recursive, the worst case does not include the recursion' % function)
+
+  return 0
+
+
+if __name__ == '__main__':
+  sys.exit(main(sys.argv[1:]))
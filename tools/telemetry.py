@@ -0,0 +1,75 @@
+#!/usr/bin/env python3
+"""Decode the records a TELEMETRY build sends on PB3.
+
+usage: telemetry.py [capture]
+
+Reads the raw bytes captured from PB3 at 9600 baud 8N1, from the file or from
+stdin, e.g. stty -F /dev/ttyUSB0 9600 raw && telemetry.py < /dev/ttyUSB0
+
+Prints one line per record that adds up, with the time, the alarm, snooze and
+supply state, the display frames shown in the last second, the bytes of stack
+never used and the longest each interrupt has taken, in cycles. Bytes that
+aren't part of a good record are skipped and counted.
+"""
+
+import struct
+import sys
+
+SYNC = 0xA5 #TELEMETRY_SYNC
+RECORD = struct.Struct('<BBBBBHH6BB') #struct telemetry, low byte first
+PM = 0x80
+ALARM_ON, SNOOZE, ALARM_GOING = 0x01, 0x02, 0x04
+SUPPLY_SHIFT = 3
+SUPPLY_STATES = ('good', 'low', 'weak', '?')
+ISR_NAMES = ('second', 'slot', 'dark', 'tone', 'light', 'serial') #TRACE_ interrupts
+TIMER2_CYCLES = (8, 8, 32, 8) #Cycles per Timer 2 click, by supply state
+
+
+def decode(record):
+  fields = RECORD.unpack(record)
+  hours, minutes, seconds, state, refresh, stack_free = fields[1:7]
+  isr_max = fields[7:7 + len(ISR_NAMES)]
+  supply = (state >> SUPPLY_SHIFT) & 3
+
+  line = '%2d:%02d:%02d %s' % (hours & ~PM, minutes, seconds, 'PM' if hours & PM else 'AM')
+  line += '  alarm %-3s' % ('on' if state & ALARM_ON else 'off')
+  line += ' snooze' if state & SNOOZE else ''
+  line += ' going' if state & ALARM_GOING else ''
+  line += '  supply %s  refresh %dHz  stack_free %d  isr' % (SUPPLY_STATES[supply], refresh, stack_free)
+  for name, clicks in zip(ISR_NAMES, isr_max):
+    line += ' %s %d' % (name, clicks * TIMER2_CYCLES[supply])
+  return line
+
+
+def main(args):
+  if len(args) > 1:
+    sys.stderr.write(__doc__)
+    return 1
+
+  capture = open(args[0], 'rb') if args else sys.stdin.buffer
+  buffer = b''
+  skipped = 0
+  records = 0
+
+  while True:
+    data = capture.read(RECORD.size)
+    if not data:
+      break
+    buffer += data
+
+    while len(buffer) >= RECORD.size:
+      if buffer[0] != SYNC or sum(buffer[:RECORD.size]) & 0xFF != 0:
+        buffer = buffer[1:]
+        skipped += 1
+        continue
+      print(decode(buffer[:RECORD.size]))
+      sys.stdout.flush()
+      buffer = buffer[RECORD.size:]
+      records += 1
+
+  sys.stderr.write('%d records, %d bytes skipped\n' % (records, skipped + len(buffer)))
+  return 0
+
+
+if __name__ == '__main__':
+  sys.exit(main(sys.argv[1:]))